@@ -7,4 +7,6 @@ exec ~/src/tll/build/bench/tll-bench-channel -m build/tll-lua --count=1000000 --
 	'lua+null://;code=file://bench/nested.lua;scheme=yaml://bench/scheme.yaml' \
 	'lua+null://;code=file://bench/many.lua;scheme=yaml://bench/scheme.yaml' \
 	'lua+null://;code=file://bench/static.lua;scheme=yaml://bench/scheme.yaml' \
+	'lua+null://;code=file://bench/builder.lua;scheme=yaml://bench/scheme.yaml' \
+	'lua+null://;code=file://bench/hooks.lua;scheme=yaml://bench/scheme.yaml' \
 	'lua+null://;code=file://bench/object.lua;scheme=yaml://bench/scheme.yaml;lua.message-mode=object'
@@ -0,0 +1,19 @@
+counter = 0
+function tll_on_active()
+    message = tll_self_child:builder("Many")
+    message.f1 = 10
+    message.f2 = 20
+    message.f3 = 30
+    message.f4 = 40
+    message.f5 = 50
+    message.f6 = 60
+    message.f7 = 70
+    message.f8 = 80
+    message.f9 = 90
+end
+
+function tll_on_post(seq, name, data)
+    counter = counter + 1
+    message.f0 = counter
+    message:post(seq)
+end
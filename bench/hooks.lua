@@ -0,0 +1,5 @@
+-- Fill globals table to make name lookup closer to real scripts
+for i = 1, 1000 do _G["global_" .. i] = i end
+
+function tll_on_post(seq, name, data)
+end
@@ -5,6 +5,10 @@
  * it under the terms of the MIT license. See LICENSE for details.
  */
 
+#include "tll/lua/cache.h"
+#include "tll/lua/frame.h"
+#include "tll/lua/handlers.h"
+#include "tll/lua/index.h"
 #include "tll/lua/luat.h"
 #include "tll/lua/message.h"
 #include "tll/lua/reflection.h"
@@ -122,6 +126,64 @@ static constexpr std::string_view scheme_enum_string = R"(yamls://
     - {name: f0, type: Enum}
 )";
 
+static constexpr std::string_view reflection_lua = R"(
+function access_none(data) return 0 end
+function access_first(data) return data.f0 end
+function access_last(data) return data.f9 end
+function access_all(data)
+	return data.f0 + data.f1 + data.f2 + data.f3 + data.f4 + data.f5 + data.f6 + data.f7 + data.f8 + data.f9
+end
+)";
+
+// Same as Many message from bench/scheme.yaml
+static constexpr std::string_view scheme_many_string = R"(yamls://
+- name: Many
+  id: 30
+  fields:
+    - {name: f0, type: int64}
+    - {name: f1, type: uint16}
+    - {name: f2, type: uint16}
+    - {name: f3, type: uint16}
+    - {name: f4, type: uint16}
+    - {name: f5, type: uint16}
+    - {name: f6, type: uint16}
+    - {name: f7, type: uint16}
+    - {name: f8, type: uint16}
+    - {name: f9, type: uint16}
+)";
+
+static constexpr std::string_view nested_lua = R"(
+function access_nested(data)
+	return data.f0.s0 + data.list[1].s0 + data.list[4].s0
+end
+)";
+
+static constexpr std::string_view scheme_nested_string = R"(yamls://
+- name: Simple
+  id: 10
+  fields:
+    - {name: s0, type: uint16}
+- name: Nested
+  id: 20
+  fields:
+    - {name: header, type: int32}
+    - {name: f0, type: Simple}
+    - {name: list, type: 'Simple[4]'}
+)";
+
+static constexpr std::string_view scheme_presets_string = R"(yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: i0, type: int32}
+    - {name: e0, type: uint8, options.type: enum, enum: {A: 1, B: 2}}
+    - {name: b0, type: uint16, options.type: bits, bits: [a, b, c]}
+    - {name: fx, type: int64, options.type: fixed3}
+    - {name: ts, type: int64, options.type: time_point, options.resolution: us}
+    - {name: d0, type: double}
+    - {name: d128, type: decimal128}
+)";
+
 std::string_view pack(lua_State * lua, const tll_msg_t *msg)
 {
 	lua_getglobal(lua, "frame_pack");
@@ -174,6 +236,16 @@ int pack_unpack(lua_State *lua, tll_msg_t &msg)
 	return msg.size - i;
 }
 
+int pack_unpack_native(const FrameFormat &frame, tll_msg_t &msg)
+{
+	auto i = ++msg.size;
+	char buf[64];
+	frame.pack(&msg, buf);
+	msg.size = 0;
+	frame.unpack(buf, &msg);
+	return msg.size - i;
+}
+
 int bench_frame(tll::Logger &log)
 {
 	std::unique_ptr<lua_State, decltype(&lua_close)> lua_ptr(init(zabbix_lua), lua_close);
@@ -196,6 +268,25 @@ int bench_frame(tll::Logger &log)
 	if (delta)
 		return log.fail(EINVAL, "Pack/unpack calls does not match: non zero delta {}", delta);
 
+	FrameFormat native;
+	if (native.init("c5 I8"))
+		return log.fail(EINVAL, "Failed to parse frame format: {}", native.error);
+	lua_newtable(lua);
+	lua_pushstring(lua, "ZBXD\x01");
+	lua_rawseti(lua, -2, 1);
+	lua_pushstring(lua, "size");
+	lua_rawseti(lua, -2, 2);
+	if (native.bind(lua, -1))
+		return log.fail(EINVAL, "Failed to bind frame fields: {}", native.error);
+	lua_pop(lua, 1);
+
+	tll::bench::timeit(count, "frame (native)", pack_unpack_native, native, msg);
+
+	msg.size = 100;
+	delta = pack_unpack_native(native, msg);
+	if (delta)
+		return log.fail(EINVAL, "Native pack/unpack calls does not match: non zero delta {}", delta);
+
 	return 0;
 }
 
@@ -226,6 +317,23 @@ int callT(lua_State *lua, int x, std::string_view name)
 	return x - r;
 }
 
+/// Same as callT but function is taken from registry reference
+template <size_t Size>
+int callRefT(lua_State *lua, int x, const Hook &hook)
+{
+	hook.push(lua);
+	x++;
+	for (auto i = 0u; i < Size; i++)
+		lua_pushinteger(lua, x);
+	if (lua_pcall(lua, Size, 1, 0)) {
+		fmt::print("call {} failed: {}\n", hook.name, lua_tostring(lua, -1));
+		return EINVAL;
+	}
+	auto r = lua_tointeger(lua, -1);
+	lua_pop(lua, 1);
+	return x - r;
+}
+
 template <typename T>
 int push(lua_State *lua, T value)
 {
@@ -369,6 +477,13 @@ int bench_call(tll::Logger &log)
 	tll::bench::timeit(count, "call5", callT<5>, lua, x, "call5"); x = 0;
 	tll::bench::timeit(count, "call10", callT<10>, lua, x, "call10"); x = 0;
 	tll::bench::timeit(count, "call1", callT<1>, lua, x, "call1"); x = 0;
+
+	Hook call0_hook = { "call0" }, call5_hook = { "call5" };
+	if (!call0_hook.bind(lua) || !call5_hook.bind(lua))
+		return log.fail(EINVAL, "Failed to bind call functions");
+	tll::bench::timeit(count, "call0 (ref)", callRefT<0>, lua, x, call0_hook); x = 0;
+	tll::bench::timeit(count, "call5 (ref)", callRefT<5>, lua, x, call5_hook); x = 0;
+
 	tll::bench::timeit(count, "call(call1)", callT<1>, lua, x, "call_call1"); x = 0;
 	tll::bench::timeit(count, "call(call(call1))", callT<1>, lua, x, "call_call_call1"); x = 0;
 	tll::bench::timeit(count, "call10", callT<10>, lua, x, "call10"); x = 0;
@@ -412,6 +527,217 @@ int bench_call(tll::Logger &log)
 	return 0;
 }
 
+int call_reflection(lua_State *lua, std::string_view name, const tll::scheme::Message * message, const tll_msg_t &msg, const Settings &settings)
+{
+	lua_getglobal(lua, name.data());
+	luaT_push(lua, reflection::Message { message, tll::make_view(msg), settings });
+	if (lua_pcall(lua, 1, 1, 0)) {
+		fmt::print("call {} failed: {}\n", name, lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+		return EINVAL;
+	}
+	auto r = lua_tointeger(lua, -1);
+	lua_pop(lua, 1);
+	return r;
+}
+
+int bench_reflection(tll::Logger &log)
+{
+	std::unique_ptr<lua_State, decltype(&lua_close)> lua_ptr(init(reflection_lua), lua_close);
+	auto lua = lua_ptr.get();
+	if (!lua)
+		return log.fail(EINVAL, "Failed to init lua state");
+
+	LuaT<reflection::Message>::init(lua);
+
+	tll::scheme::SchemePtr scheme { tll::Scheme::load(scheme_many_string) };
+	if (!scheme)
+		return log.fail(EINVAL, "Failed to load scheme");
+	auto message = scheme->messages;
+
+	std::vector<char> buf(message->size);
+	tll_msg_t msg = {};
+	msg.msgid = message->msgid;
+	msg.data = buf.data();
+	msg.size = buf.size();
+
+	Settings settings = {};
+	tll::bench::timeit(count, "reflection: baseline", call_reflection, lua, "access_none", message, msg, settings);
+	tll::bench::timeit(count, "reflection: linear f0", call_reflection, lua, "access_first", message, msg, settings);
+	tll::bench::timeit(count, "reflection: linear f9", call_reflection, lua, "access_last", message, msg, settings);
+	tll::bench::timeit(count, "reflection: linear f0..f9", call_reflection, lua, "access_all", message, msg, settings);
+
+	SchemeIndex index;
+	index.add(scheme.get());
+	settings.index = &index;
+	tll::bench::timeit(count, "reflection: cached f0", call_reflection, lua, "access_first", message, msg, settings);
+	tll::bench::timeit(count, "reflection: cached f9", call_reflection, lua, "access_last", message, msg, settings);
+	tll::bench::timeit(count, "reflection: cached f0..f9", call_reflection, lua, "access_all", message, msg, settings);
+	return 0;
+}
+
+int call_pooled(lua_State *lua, std::string_view name, reflection::Pool &pool, const tll::scheme::Message * message, const tll_msg_t &msg, const Settings &settings)
+{
+	auto scope = pool.scope();
+	lua_getglobal(lua, name.data());
+	pool.push(lua, reflection::Message { message, tll::make_view(msg), settings });
+	if (lua_pcall(lua, 1, 1, 0)) {
+		fmt::print("call {} failed: {}\n", name, lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+		return EINVAL;
+	}
+	auto r = lua_tointeger(lua, -1);
+	lua_pop(lua, 1);
+	return r;
+}
+
+long long gc_count(lua_State * lua)
+{
+	return lua_gc(lua, LUA_GCCOUNT, 0) * 1024ll + lua_gc(lua, LUA_GCCOUNTB, 0);
+}
+
+/// Report number of bytes allocated by Lua per call, garbage collector is stopped during measurement
+template <typename F, typename... Args>
+void gc_bytes(unsigned count, std::string_view name, lua_State * lua, F f, Args && ... args)
+{
+	lua_gc(lua, LUA_GCCOLLECT, 0);
+	lua_gc(lua, LUA_GCSTOP, 0);
+	auto start = gc_count(lua);
+	for (auto i = 0u; i < count; i++)
+		f(lua, std::forward<Args>(args)...);
+	auto end = gc_count(lua);
+	lua_gc(lua, LUA_GCRESTART, 0);
+	lua_gc(lua, LUA_GCCOLLECT, 0);
+	fmt::print("{}: {:.1f} GC bytes per message\n", name, (double) (end - start) / count);
+}
+
+int bench_nested(tll::Logger &log)
+{
+	std::unique_ptr<lua_State, decltype(&lua_close)> lua_ptr(init(nested_lua), lua_close);
+	auto lua = lua_ptr.get();
+	if (!lua)
+		return log.fail(EINVAL, "Failed to init lua state");
+
+	LuaT<reflection::Message>::init(lua);
+	LuaT<reflection::Array>::init(lua);
+
+	tll::scheme::SchemePtr scheme { tll::Scheme::load(scheme_nested_string) };
+	if (!scheme)
+		return log.fail(EINVAL, "Failed to load scheme");
+	auto message = scheme->lookup("Nested");
+	if (!message)
+		return log.fail(EINVAL, "Message Nested not found");
+	auto list = message->fields->next->next;
+
+	std::vector<char> buf(message->size);
+	auto view = tll::make_view(buf);
+	tll::scheme::write_size(list->count_ptr, view.view(list->offset + list->count_ptr->offset), 4);
+
+	tll_msg_t msg = {};
+	msg.msgid = message->msgid;
+	msg.data = buf.data();
+	msg.size = buf.size();
+
+	Settings settings = {};
+	reflection::Pool pool;
+
+	tll::bench::timeit(count, "nested: new userdata", call_reflection, lua, "access_nested", message, msg, settings);
+	gc_bytes(count / 10, "nested: new userdata", lua, call_reflection, "access_nested", message, msg, settings);
+
+	settings.reflection_cache = true;
+	tll::bench::timeit(count, "nested: reflection cache", call_pooled, lua, "access_nested", pool, message, msg, settings);
+	gc_bytes(count / 10, "nested: reflection cache", lua, call_pooled, "access_nested", pool, message, msg, settings);
+	return 0;
+}
+
+int push_fields(lua_State *lua, const tll::scheme::Message * message, const tll::memoryview<const tll_msg_t> &view, const Settings &settings)
+{
+	for (auto f = message->fields; f; f = f->next)
+		tll::lua::pushfield(lua, f, view.view(f->offset), settings);
+	lua_settop(lua, 0);
+	return 0;
+}
+
+int bench_presets(tll::Logger &log)
+{
+	std::unique_ptr<lua_State, decltype(&lua_close)> lua_ptr(init(""), lua_close);
+	auto lua = lua_ptr.get();
+	if (!lua)
+		return log.fail(EINVAL, "Failed to init lua state");
+
+	LuaT<reflection::Bits>::init(lua);
+	LuaT<reflection::Fixed>::init(lua);
+	LuaT<reflection::Decimal128>::init(lua);
+	LuaT<tll::lua::TimePoint>::init(lua);
+
+	tll::scheme::SchemePtr scheme { tll::Scheme::load(scheme_presets_string) };
+	if (!scheme)
+		return log.fail(EINVAL, "Failed to load scheme");
+	auto message = scheme->messages;
+
+	std::vector<char> buf(message->size);
+	*(uint8_t *) (buf.data() + message->fields->next->offset) = 1; // Valid enum value
+	tll_msg_t msg = {};
+	msg.msgid = message->msgid;
+	msg.data = buf.data();
+	msg.size = buf.size();
+	auto view = tll::make_view(static_cast<const tll_msg_t &>(msg));
+
+	Settings filter, convert, fast;
+	filter.enum_mode = Settings::Enum::String;
+	filter.bits_mode = Settings::Bits::Object;
+	filter.fixed_mode = Settings::Fixed::Float;
+	filter.decimal128_mode = Settings::Decimal128::Float;
+	filter.time_mode = Settings::Time::Object;
+
+	convert = filter;
+	convert.fixed_mode = Settings::Fixed::Object;
+	convert.decimal128_mode = Settings::Decimal128::Object;
+
+	fast.enum_mode = Settings::Enum::Int;
+	fast.bits_mode = Settings::Bits::Int;
+	fast.fixed_mode = Settings::Fixed::Int;
+	fast.decimal128_mode = Settings::Decimal128::Object;
+	fast.time_mode = Settings::Time::Int;
+
+	for (auto & [name, settings] : { std::pair<std::string_view, Settings &> { "filter", filter }, { "convert", convert }, { "convert-fast", fast } }) {
+		auto generic = fmt::format("preset {}: generic", name);
+		auto special = fmt::format("preset {}: specialized", name);
+		tll::bench::timeit(count, generic, push_fields, lua, message, view, settings);
+		settings.pushfield = select_pushfield(settings);
+		if (!settings.pushfield)
+			return log.fail(EINVAL, "No specialized pusher for preset {}", name);
+		tll::bench::timeit(count, special, push_fields, lua, message, view, settings);
+	}
+	return 0;
+}
+
+/// New Lua state with loaded code, approximation of channel open
+template <bool Cached>
+int load_state(std::string_view code)
+{
+	std::unique_ptr<lua_State, decltype(&lua_close)> lua(luaL_newstate(), lua_close);
+	auto r = Cached ? ChunkCache::instance().load(lua.get(), code) : luaL_loadbuffer(lua.get(), code.data(), code.size(), "bench");
+	if (r)
+		return EINVAL;
+	return lua_pcall(lua.get(), 0, 0, 0);
+}
+
+int bench_chunk(tll::Logger &log)
+{
+	std::string code;
+	for (auto i = 0; i < 200; i++)
+		code += fmt::format("function func_{}(seq, name, data)\n  if data.f0 > {} then return data.f1 * {} end\n  return nil\nend\n", i, i, i);
+
+	if (load_state<true>(code)) // Fill cache
+		return log.fail(EINVAL, "Failed to load code");
+
+	constexpr auto channels = 500u;
+	tll::bench::timeit(channels, "open (compile)", load_state<false>, code);
+	tll::bench::timeit(channels, "open (cache)", load_state<true>, code);
+	return 0;
+}
+
 int main()
 {
 	tll::Logger log("bench");
@@ -420,5 +746,13 @@ int main()
 	bench_frame(log);
 	tll::bench::prewarm(100ms);
 	bench_call(log);
+	tll::bench::prewarm(100ms);
+	bench_reflection(log);
+	tll::bench::prewarm(100ms);
+	bench_nested(log);
+	tll::bench::prewarm(100ms);
+	bench_presets(log);
+	tll::bench::prewarm(100ms);
+	bench_chunk(log);
 	return 0;
 }
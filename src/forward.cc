@@ -34,16 +34,19 @@ int Forward::_open(const tll::ConstConfig &cfg)
 	if (auto s = _input->state(); s == tll::state::Active)
 		_input_scheme = _input->scheme();
 
+	_index.add(_output_scheme);
+	_index.add(_input_scheme);
+
 	if (auto r = _lua_open(); r)
 		return r;
 
-	_on_data_name = "";
-	lua_getglobal(_lua, "tll_on_data");
-	if (lua_isfunction(_lua, -1))
-		_on_data_name = "tll_on_data";
-	lua_pop(_lua, 1);
+	_lua_hooks_bind(_lua);
+	if (_input_scheme) {
+		if (auto r = _lua_handlers_build(_input_scheme); r)
+			return r;
+	}
 
-	if (_on_data_name.empty())
+	if (!_on_data && !_batch_enabled && !tll::lua::MessageHandlers::defined(_lua, "tll_on_data_"))
 		return _log.fail(EINVAL, "Can not find callback function");
 
 	luaT_push<tll::lua::Channel>(_lua, { self(), &_encoder });
@@ -65,6 +68,15 @@ int Forward::_open(const tll::ConstConfig &cfg)
 	lua_pushcclosure(_lua, _lua_forward, 1);
 	lua_setglobal(_lua, "tll_output_post");
 
+	lua_pushlightuserdata(_lua, this->channelT());
+	lua_pushcclosure(_lua, _lua_forward_batch, 1);
+	lua_setglobal(_lua, "tll_output_post_batch");
+
+	if (_shards && _input_scheme) {
+		if (auto r = _shard_start(_on_data.name, false, true, _input_scheme, _input); r)
+			return r;
+	}
+
 	if (auto r = _lua_on_open(cfg); r)
 		return r;
 
@@ -74,25 +86,52 @@ int Forward::_open(const tll::ConstConfig &cfg)
 int Forward::callback_tag(TaggedChannel<Input> * c, const tll_msg_t *msg)
 {
 	if (msg->type != TLL_MESSAGE_DATA) {
-		if (msg->type == TLL_MESSAGE_STATE && msg->msgid == tll::state::Active)
+		if (!_batch.empty())
+			_batch_flush();
+		if (msg->type == TLL_MESSAGE_STATE && msg->msgid == tll::state::Active) {
 			_input_scheme = c->scheme();
+			_index.add(_input_scheme);
+			if (auto r = _lua_handlers_build(_input_scheme); r)
+				return state_fail(r, "Failed to resolve message handlers");
+			if (_shards) {
+				if (auto r = _shard_start(_on_data.name, false, true, _input_scheme, _input); r)
+					return state_fail(r, "Failed to start shard workers");
+			}
+		}
 		return 0;
 	}
 
+	if (!_shard_workers.empty())
+		return _shard_push(msg, _input_scheme, c);
+
+	if (_batch_enabled)
+		return _batch_push(msg, _input_scheme, c);
+
+	auto hook = _handlers.lookup(msg->msgid);
+	if (!hook) {
+		if (!_on_data) // Only per-message hooks are defined, skip message
+			return 0;
+		hook = &_on_data;
+	}
+
 	auto ref = _lua.copy();
 	auto guard = tll::lua::StackGuard(ref);
+	auto scope = _reflection_pool.scope();
 
-	lua_getglobal(ref, _on_data_name.c_str());
-	auto args = _lua_pushmsg(msg, _input_scheme, c, true);
-	if (args < 0)
+	const auto start = _hook_start();
+	hook->push(ref);
+	auto r = luaT_pcallpush(ref, 1, [&](lua_State * lua) { return _lua_pushmsg(lua, msg, _input_scheme, c, true); });
+	if (r < 0)
 		return state_fail(EINVAL, "Failed to push message to Lua");
 
-	if (lua_pcall(ref, args, 1, 0)) {
-		auto text = fmt::format("Lua function {} failed: {}\n  on", _on_data_name, lua_tostring(ref, -1));
+	if (r) {
+		auto text = fmt::format("Lua function {} failed: {}\n  on", hook->name, lua_tostring(ref, -1));
 		tll_channel_log_msg(_input, _log.name(), tll::logger::Error, _dump_error, msg, text.data(), text.size());
+		_lua_stat(HookKind::Data, start, true);
 		state(tll::state::Error);
 		return EINVAL;
 	}
 
+	_lua_stat(HookKind::Data, start);
 	return 0;
 }
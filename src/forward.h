@@ -19,7 +19,7 @@ class Forward : public tll::lua::LuaBase<Forward, tll::channel::Tagged<Forward,
 	tll::Channel * _input = nullptr;
 	const tll::Scheme * _input_scheme = nullptr;
 
-	std::string _on_data_name;
+	tll::lua::Hook _on_data = { "tll_on_data" };
 	bool _prefix_compat = false;
 
  public:
@@ -41,11 +41,42 @@ class Forward : public tll::lua::LuaBase<Forward, tll::channel::Tagged<Forward,
 	int callback_tag(TaggedChannel<Input> * c, const tll_msg_t *msg);
 	int callback_tag(TaggedChannel<Output> * c, const tll_msg_t *msg) { return 0; }
 
+	int _lua_hooks_bind(lua_State * lua)
+	{
+		_on_data.bind(lua);
+		return Base::_lua_hooks_bind(lua);
+	}
+
+	void _lua_hooks_reset(lua_State * lua)
+	{
+		_on_data.reset(lua);
+		Base::_lua_hooks_reset(lua);
+	}
+
+	void _lua_shard_init(lua_State * lua, tll::lua::ShardWorker &worker)
+	{
+		worker.targets[tll::lua::ShardOutput::Post] = { _output_scheme, _output };
+		worker.add_output(lua, "tll_output_post", tll::lua::ShardOutput::Post);
+		worker.add_output_batch(lua, "tll_output_post_batch", tll::lua::ShardOutput::Post);
+		if (_prefix_compat)
+			worker.add_output(lua, "tll_callback", tll::lua::ShardOutput::Post);
+	}
+
+	void _shard_output(int target, const tll_msg_t * msg)
+	{
+		if (target == tll::lua::ShardOutput::Post)
+			_output->post(msg);
+		else
+			Base::_shard_output(target, msg);
+	}
+
  private:
 	static int _lua_forward(lua_State * lua)
 	{
 		if (auto self = _lua_self(lua, 1); self) {
+			const auto start = self->_hook_start();
 			auto msg = self->_encoder.encode_stack(lua, self->_output_scheme, self->_output, 0);
+			self->_encode_stat(start, !msg);
 			if (!msg) {
 				self->_log.error("Failed to convert message: {}", self->_encoder.error);
 				return luaL_error(lua, "Failed to convert message");
@@ -56,6 +87,29 @@ class Forward : public tll::lua::LuaBase<Forward, tll::channel::Tagged<Forward,
 		return luaL_error(lua, "Non-userdata value in upvalue");
 	}
 
+	/// Post list of messages into output channel
+	static int _lua_forward_batch(lua_State * lua)
+	{
+		if (auto self = _lua_self(lua, 1); self) {
+			luaL_checktype(lua, 1, LUA_TTABLE);
+			auto size = luaL_len(lua, 1);
+			for (auto i = 1; i <= size; i++) {
+				lua_settop(lua, 1);
+				lua_rawgeti(lua, 1, i);
+				const auto start = self->_hook_start();
+				auto msg = self->_encoder.encode_stack(lua, self->_output_scheme, self->_output, 1);
+				self->_encode_stat(start, !msg);
+				if (!msg) {
+					self->_log.error("Failed to convert message {}: {}", i, self->_encoder.error);
+					return luaL_error(lua, "Failed to convert message %d", i);
+				}
+				self->_output->post(msg);
+			}
+			return 0;
+		}
+		return luaL_error(lua, "Non-userdata value in upvalue");
+	}
+
 	static char * _stream_mode(int * len, void * data)
 	{
 		auto self = static_cast<const Forward *>(data);
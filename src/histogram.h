@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _LUA_HISTOGRAM_H
+#define _LUA_HISTOGRAM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace tll::lua {
+
+/**
+ * Log-linear histogram for non-negative values, similar to HDR histogram
+ *
+ * Each power of two range is split into ``2^precision`` buckets so relative error of reported
+ * quantile is below ``2^-precision``. Memory is allocated once in constructor.
+ */
+class Histogram
+{
+	static constexpr unsigned precision = 7;
+	static constexpr uint64_t sub_count = 1ull << precision;
+
+	std::vector<uint64_t> _buckets;
+	uint64_t _count = 0;
+	int64_t _min = 0;
+	int64_t _max = 0;
+
+	static size_t _index(uint64_t v)
+	{
+		if (v < sub_count)
+			return v;
+		const unsigned shift = 63 - __builtin_clzll(v) - precision;
+		return ((shift + 1) << precision) + ((v >> shift) - sub_count);
+	}
+
+	/// Middle of the bucket
+	static int64_t _value(size_t idx)
+	{
+		if (idx < sub_count)
+			return idx;
+		const unsigned shift = (idx >> precision) - 1;
+		const uint64_t lower = (sub_count + (idx & (sub_count - 1))) << shift;
+		return lower + ((1ull << shift) >> 1);
+	}
+
+ public:
+	Histogram() : _buckets(_index(std::numeric_limits<uint64_t>::max()) + 1) {}
+
+	uint64_t count() const { return _count; }
+	int64_t min() const { return _min; }
+	int64_t max() const { return _max; }
+
+	void add(int64_t v)
+	{
+		if (v < 0)
+			v = 0;
+		if (!_count)
+			_min = _max = v;
+		_min = std::min(_min, v);
+		_max = std::max(_max, v);
+		_count++;
+		_buckets[_index(v)]++;
+	}
+
+	/// Value at quantile q in [0, 1], clamped to observed min and max
+	int64_t quantile(double q) const
+	{
+		if (!_count)
+			return 0;
+		const uint64_t target = std::max<uint64_t>(1, (uint64_t) std::ceil(q * _count));
+		uint64_t sum = 0;
+		for (size_t i = 0; i < _buckets.size(); i++) {
+			sum += _buckets[i];
+			if (sum >= target)
+				return std::clamp(_value(i), _min, _max);
+		}
+		return _max;
+	}
+
+	void reset()
+	{
+		if (!_count)
+			return;
+		std::fill(_buckets.begin(), _buckets.end(), 0);
+		_count = 0;
+		_min = _max = 0;
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_LUA_HISTOGRAM_H
@@ -33,12 +33,17 @@ int Logic::_open(const tll::ConstConfig &cfg)
 		auto idx = 0;
 		for (auto &c : list) {
 			_log.debug("Channel {} -> callback {}", c->name(), name);
-			if (auto r = _functions.emplace(c, name); !r.second) {
-				if (r.first->second != name)
-					return _log.fail(EINVAL, "Channel {} has different callbacks: {} and {} from different tags", c->name(), name, r.first->second);
-			}
+			auto [it, inserted] = _functions.emplace(c, Callback { Hook { name }, fmt::format("tll_on_channel_{}_", t), c });
+			auto & cb = it->second;
+			if (!inserted && cb.function.name != name)
+				return _log.fail(EINVAL, "Channel {} has different callbacks: {} and {} from different tags", c->name(), name, cb.function.name);
 			lua_pushinteger(_lua, ++idx);
-			luaT_push<tll::lua::Channel>(_lua, { c, &_encoder });
+			if (cb.channel_ref == LUA_NOREF) {
+				luaT_push<tll::lua::Channel>(_lua, { c, &_encoder });
+				lua_pushvalue(_lua, -1);
+				cb.channel_ref = luaL_ref(_lua, LUA_REGISTRYINDEX);
+			} else
+				lua_rawgeti(_lua, LUA_REGISTRYINDEX, cb.channel_ref);
 			lua_settable(_lua, -3);
 		}
 		lua_settable(_lua, -3);
@@ -48,9 +53,7 @@ int Logic::_open(const tll::ConstConfig &cfg)
 	luaT_push<tll::lua::Channel>(_lua, { self(), &_encoder });
 	lua_setglobal(_lua, "tll_self");
 
-	lua_getglobal(_lua, "tll_on_post");
-	_with_on_post = lua_isfunction(_lua, -1);
-	lua_pop(_lua, 1);
+	_lua_hooks_bind(_lua);
 
 	if (auto r = _lua_on_open(cfg); r)
 		return r;
@@ -63,37 +66,82 @@ int Logic::logic(const tll::Channel * c, const tll_msg_t *msg)
 	auto it = _functions.find(c);
 	if (it == _functions.end())
 		return _log.fail(EINVAL, "Channel {} is not found in function map", c->name());
-	return _on_msg(msg, c->scheme(), it->first, it->second);
+	auto & cb = it->second;
+	if (msg->type == TLL_MESSAGE_DATA) {
+		if (auto scheme = c->scheme(); scheme != cb.scheme) {
+			_index.add(scheme); // Keep scheme referenced so pointer comparison stays valid
+			cb.scheme = scheme;
+			cb.handlers.build(_lua, scheme, cb.prefix);
+		}
+		if (auto h = cb.handlers.lookup(msg->msgid); h)
+			return _on_msg(msg, cb.scheme, cb.channel, *h, cb.channel_ref);
+	}
+	return _on_msg(msg, c->scheme(), cb.channel, cb.function, cb.channel_ref);
+}
+
+int Logic::_lua_hooks_bind(lua_State * lua)
+{
+	_on_post.bind(lua);
+	for (auto & [_, cb] : _functions) {
+		cb.function.bind(lua);
+		cb.handlers.rebind(lua);
+	}
+	return Base::_lua_hooks_bind(lua);
+}
+
+void Logic::_lua_hooks_reset(lua_State * lua)
+{
+	_on_post.reset(lua);
+	for (auto & [_, cb] : _functions) {
+		cb.function.reset(lua);
+		cb.handlers.reset(lua);
+		cb.scheme = nullptr;
+		if (lua && cb.channel_ref != LUA_NOREF)
+			luaL_unref(lua, LUA_REGISTRYINDEX, cb.channel_ref);
+		cb.channel_ref = LUA_NOREF;
+	}
+	Base::_lua_hooks_reset(lua);
 }
 
 int Logic::_post(const tll_msg_t *msg, int flags)
 {
-	if (!_with_on_post)
+	if (!_on_post)
 		return Base::_post(msg, flags);
-	if (_on_msg(msg, _scheme.get(), self(), "tll_on_post"))
+	if (_on_msg(msg, _scheme.get(), self(), _on_post))
 		return EINVAL;
 	return 0;
 }
 
-int Logic::_on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, tll::Channel * channel, std::string_view func)
+int Logic::_on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, tll::Channel * channel, const Hook &hook, int channel_ref)
 {
 	auto ref = _lua.copy();
-	lua_getglobal(ref, func.data());
+	auto scope = _reflection_pool.scope();
+	const auto kind = channel == self() ? HookKind::Post : HookKind::Data;
+	const auto start = _hook_start();
+	hook.push(ref);
 
 	auto extra_args = 0;
 	if (channel != self()) {
-		luaT_push<tll::lua::Channel>(ref, { channel, &_encoder });
+		if (channel_ref != LUA_NOREF)
+			lua_rawgeti(ref, LUA_REGISTRYINDEX, channel_ref);
+		else
+			luaT_push<tll::lua::Channel>(ref, { channel, &_encoder });
 		extra_args++;
 	}
-	auto args = _lua_pushmsg(msg, scheme, channel);
-	if (args < 0)
+	auto r = luaT_pcallpush(ref, 0, [&](lua_State * lua) {
+		auto args = _lua_pushmsg(lua, msg, scheme, channel);
+		return args < 0 ? args : args + extra_args;
+	});
+	if (r < 0)
 		return EINVAL;
-	if (lua_pcall(ref, extra_args + args, 0, 0)) {
-		auto text = fmt::format("Lua function {} failed: {}\n  on", func, lua_tostring(ref, -1));
+	if (r) {
+		auto text = fmt::format("Lua function {} failed: {}\n  on", hook.name, lua_tostring(ref, -1));
 		lua_pop(ref, 1);
 		tll_channel_log_msg(channel, _log.name(), tll::logger::Error, _dump_error, msg, text.data(), text.size());
+		_lua_stat(kind, start, true);
 		return EINVAL;
 	}
 
+	_lua_stat(kind, start);
 	return 0;
 }
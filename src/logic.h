@@ -8,7 +8,7 @@
 
 #include <tll/channel/logic.h>
 
-#include <map>
+#include <unordered_map>
 
 namespace tll::lua {
 
@@ -16,8 +16,18 @@ class Logic : public tll::lua::LuaBase<Logic, tll::channel::Logic<Logic>>
 {
 	using Base = tll::lua::LuaBase<Logic, tll::channel::Logic<Logic>>;
 
-	bool _with_on_post;
-	std::map<tll::Channel *, std::string, std::less<>> _functions;
+	Hook _on_post = { "tll_on_post" };
+
+	struct Callback
+	{
+		Hook function; ///< tll_on_channel_<tag> or tll_on_channel
+		std::string prefix; ///< Prefix for per-message hooks, tll_on_channel_<tag>_
+		tll::Channel * channel = nullptr;
+		int channel_ref = LUA_NOREF; ///< Channel object created once and passed to each callback
+		const tll::Scheme * scheme = nullptr; ///< Scheme used to resolve per-message hooks
+		MessageHandlers handlers;
+	};
+	std::unordered_map<const tll::Channel *, Callback> _functions;
 
  public:
 	static constexpr std::string_view channel_protocol() { return "lua"; }
@@ -28,7 +38,10 @@ class Logic : public tll::lua::LuaBase<Logic, tll::channel::Logic<Logic>>
 
 	int _post(const tll_msg_t *msg, int flags);
 
-	int _on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, tll::Channel * c, std::string_view func);
+	int _on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, tll::Channel * c, const Hook &hook, int channel_ref = LUA_NOREF);
+
+	int _lua_hooks_bind(lua_State * lua);
+	void _lua_hooks_reset(lua_State * lua);
 };
 
 } // namespace tll::lua
@@ -7,8 +7,16 @@ int LuaMeasure::_init(const tll::Channel::Url &url, tll::Channel *master)
 {
 	auto reader = channel_props_reader(url);
 	_manual_open = reader.getT("open-mode", false, {{"lua", true}, {"normal", false}});
+	_window = reader.getT("window", _window);
+	_key_window = reader.getT("key-window", _key_window);
+	_key_ttl = reader.getT("key-ttl", _key_ttl);
+	_summary = reader.getT("report", false, {{"sample", false}, {"summary", true}});
+	_summary_interval = reader.getT("summary-interval", _summary_interval);
+	_summary_count = reader.getT("summary-count", _summary_count);
 	if (!reader)
 		return _log.fail(EINVAL, "Invalid url: {}", reader.error());
+	if (_window == 0)
+		return _log.fail(EINVAL, "Zero window size");
 
 	if (auto count = _channels.get<Output>().size(); count != 1)
 		return _log.fail(EINVAL, "Need exactly one output, got {}", count);
@@ -30,18 +38,42 @@ int LuaMeasure::_init(const tll::Channel::Url &url, tll::Channel *master)
 	if (!_scheme.get())
 		return _log.fail(EINVAL, "Failed to load scheme");
 
+	if (_summary && _summary_interval.count()) {
+		auto curl = child_url_parse("timer://;clock=monotonic", "summary-timer");
+		if (!curl)
+			return _log.fail(EINVAL, "Failed to parse timer url: {}", curl.error());
+		curl->set("interval", tll::conv::to_string(_summary_interval));
+		_summary_timer = context().channel(*curl, self());
+		if (!_summary_timer)
+			return _log.fail(EINVAL, "Failed to create summary timer");
+		_summary_timer->callback_add(_on_summary_timer, this, TLL_MESSAGE_MASK_DATA);
+		_child_add(_summary_timer.get(), "summary-timer");
+	}
+
 	return Base::_init(url, master);
 }
 
 int LuaMeasure::_open(const tll::ConstConfig &props)
 {
+	_request_time.resize(_window);
+	_response_time.resize(_window);
+	_evictions = 0;
+	_histogram.reset();
+	_summary_last = tll::time::now();
+
 	if (auto r = _lua_open(); r)
 		return r;
 
-	lua_getglobal(_lua, "tll_on_data");
-	if (!lua_isfunction(_lua, -1))
+	_lua_hooks_bind(_lua);
+	if (!_on_data)
 		return _log.fail(EINVAL, "Function tll_on_data not defined");
-	lua_pop(_lua, 1);
+
+	if (_on_request)
+		_log.info("Key based correlation with window {}", _key_window);
+	for (auto w : { &_request_keys, &_response_keys }) { // Keep memory footprint minimal if keys are not used
+		w->resize(_on_request ? _key_window : 0);
+		w->ttl = std::chrono::duration_cast<std::chrono::nanoseconds>(_key_ttl).count();
+	}
 
 	lua_getglobal(_lua, "tll_on_open");
 	if (lua_isfunction(_lua, -1)) {
@@ -53,6 +85,9 @@ int LuaMeasure::_open(const tll::ConstConfig &props)
 	if (auto r = Base::_open(props); r)
 		return r;
 
+	if (_summary_timer && _summary_timer->open())
+		return _log.fail(EINVAL, "Failed to open summary timer");
+
 	if (!_manual_open)
 		state(tll::state::Active);
 	return 0;
@@ -60,6 +95,12 @@ int LuaMeasure::_open(const tll::ConstConfig &props)
 
 int LuaMeasure::_close()
 {
+	if (_summary_timer)
+		_summary_timer->close();
+
+	if (_summary && _histogram.count())
+		_report_summary();
+
 	if (_lua) {
 		lua_getglobal(_lua, "tll_on_close");
 		if (lua_isfunction(_lua, -1)) {
@@ -68,9 +109,38 @@ int LuaMeasure::_close()
 		}
 	}
 
+	if (auto stat = this->stat(); stat) {
+		if (auto page = stat->acquire(); page) {
+			page->evict = _evictions_total() - _evictions;
+			page->unmatch = _request_time.size() + _response_time.size() + _request_keys.size() + _response_keys.size();
+			stat->release(page);
+		}
+	}
+	_request_time.clear();
+	_response_time.clear();
+	_request_keys.clear();
+	_response_keys.clear();
+
 	return Base::_close();
 }
 
+void LuaMeasure::_free()
+{
+	if (_summary_timer)
+		_child_del(_summary_timer.get(), "summary-timer");
+	_summary_timer.reset();
+	Base::_free();
+}
+
+int LuaMeasure::_on_summary_timer(const tll_channel_t *, const tll_msg_t *, void * user)
+{
+	auto self = static_cast<LuaMeasure *>(user);
+	// Skip tick only if summary was reported by sample count recently, timer can fire a bit early
+	if (tll::time::now() - self->_summary_last >= self->_summary_interval - self->_summary_interval / 10)
+		self->_report_summary();
+	return 0;
+}
+
 int LuaMeasure::callback_tag(TaggedChannel<Input> * c, const tll_msg_t *msg)
 {
 	if (msg->type != TLL_MESSAGE_DATA)
@@ -79,39 +149,51 @@ int LuaMeasure::callback_tag(TaggedChannel<Input> * c, const tll_msg_t *msg)
 	auto ref = _lua.copy();
 	auto guard = StackGuard(ref);
 
-	lua_getglobal(_lua, "tll_on_data");
-	lua_pushinteger(_lua, msg->seq);
+	const auto start = _hook_start();
 	auto scheme = c->scheme();
-	if (scheme) {
-		auto message = scheme->lookup(msg->msgid);
-		if (!message)
-			return _log.fail(ENOENT, "Message {} not found", msg->msgid);
-		lua_pushstring(_lua, message->name);
-		luaT_push(_lua, reflection::Message { message, tll::make_view(*msg), _settings });
-	} else {
-		lua_pushnil(_lua);
-		lua_pushlstring(_lua, (const char *) msg->data, msg->size);
-	}
-	lua_pushinteger(_lua, msg->msgid);
-	lua_pushinteger(_lua, msg->addr.i64);
-	lua_pushinteger(_lua, msg->time);
-	if (lua_pcall(_lua, 6, 1, 0))
+	auto message = scheme ? scheme->lookup(msg->msgid) : nullptr;
+	if (scheme && !message)
+		return _log.fail(ENOENT, "Message {} not found", msg->msgid);
+
+	_on_data.push(_lua);
+	const auto r = luaT_pcallpush(_lua, 1, [&](lua_State * lua) {
+		lua_pushinteger(lua, msg->seq);
+		if (message) {
+			lua_pushstring(lua, message->name);
+			luaT_push(lua, reflection::Message { message, tll::make_view(*msg), _settings });
+		} else {
+			lua_pushnil(lua);
+			lua_pushlstring(lua, (const char *) msg->data, msg->size);
+		}
+		lua_pushinteger(lua, msg->msgid);
+		lua_pushinteger(lua, msg->addr.i64);
+		lua_pushinteger(lua, msg->time);
+		return 6;
+	});
+	if (r) {
+		_lua_stat(HookKind::Data, start, true);
 		return _log.fail(EINVAL, "Lua filter failed: {}", lua_tostring(_lua, -1));
+	}
+	_lua_stat(HookKind::Data, start);
 
 	if (!lua_isinteger(_lua, -1)) {
+		if (_on_request && lua_isnil(_lua, -1))
+			return 0;
 		if (!lua_isstring(_lua, -1))
 			return _log.fail(EINVAL, "Invalid return value from lua: not integer and not string");
-		auto r = luaT_tostringview(_lua, -1);
-		if (r == "active") {
+		auto s = luaT_tostringview(_lua, -1);
+		if (_on_request) // In key mode any string is a key, commands are not supported
+			return _match_response(msg->seq, MeasureKey::from_string(s), msg->time);
+		if (s == "active") {
 			if (state() == tll::state::Opening)
 				state(tll::state::Active);
-		} else if (r == "close") {
+		} else if (s == "close") {
 			if (state() != tll::state::Closing) {
 				close();
 				return 0;
 			}
 		} else
-			_log.info("Lua code reported message: {}", r);
+			_log.info("Lua code reported message: {}", s);
 		return 0;
 	}
 
@@ -122,23 +204,30 @@ int LuaMeasure::callback_tag(TaggedChannel<Input> * c, const tll_msg_t *msg)
 	if (seq < 0)
 		return 0;
 
-	auto it = _request_time.find(seq);
-	if (it == _request_time.end()) {
+	if (_on_request)
+		return _match_response(msg->seq, MeasureKey::from_int(seq), msg->time);
+
+	long long req = 0;
+	if (!_request_time.take(seq, req)) {
 		_log.debug("Store response time for {}", seq);
-		if (_response_time.size() == _map_size)
-			_response_time.erase(_response_time.begin());
-		_response_time[seq] = msg->time;
+		_response_time.insert(seq, msg->time);
 		return 0;
 	}
 
-	_report(seq, it->second, msg->time);
-	_request_time.erase(it);
-
+	_report(seq, req, msg->time);
 	return 0;
 }
 
 int LuaMeasure::callback_tag(TaggedChannel<Output> * c, const tll_msg_t *msg)
 {
+	if (_on_request) {
+		if (msg->type == TLL_MESSAGE_DATA)
+			return _on_request_msg(c, msg, msg->time);
+		if (msg->type == TLL_MESSAGE_CONTROL && msg->msgid == _output_time_msgid)
+			return _on_request_msg(c, msg, * (const long long *) msg->data);
+		return 0;
+	}
+
 	if (msg->type != TLL_MESSAGE_CONTROL)
 		return 0;
 	if (msg->msgid != _output_time_msgid)
@@ -147,33 +236,80 @@ int LuaMeasure::callback_tag(TaggedChannel<Output> * c, const tll_msg_t *msg)
 	auto time = * (const long long *) msg->data;
 	_log.debug("Request with seq {}, time {}", msg->seq, time);
 
-	auto it = _response_time.find(msg->seq);
-	if (it == _response_time.end()) {
+	long long resp = 0;
+	if (!_response_time.take(msg->seq, resp)) {
 		_log.debug("Store request time for {}", msg->seq);
-		if (_request_time.size() == _map_size)
-			_request_time.erase(_request_time.begin());
-		_request_time[msg->seq] = time;
+		_request_time.insert(msg->seq, time);
 		return 0;
 	}
 
-	_report(msg->seq, time, it->second);
-	_response_time.erase(it);
-
+	_report(msg->seq, time, resp);
 	return 0;
 }
 
+int LuaMeasure::_on_request_msg(TaggedChannel<Output> * c, const tll_msg_t *msg, long long time)
+{
+	auto ref = _lua.copy();
+	auto guard = StackGuard(ref);
+
+	_on_request.push(ref);
+	auto r = luaT_pcallpush(ref, 1, [&](lua_State * lua) { return _lua_pushmsg(lua, msg, c->scheme(), c, true); });
+	if (r < 0)
+		return EINVAL;
+	if (r)
+		return _log.fail(EINVAL, "Lua function tll_on_request failed: {}", lua_tostring(ref, -1));
+
+	MeasureKey key;
+	if (lua_isinteger(ref, -1))
+		key = MeasureKey::from_int(lua_tointeger(ref, -1));
+	else if (lua_type(ref, -1) == LUA_TSTRING)
+		key = MeasureKey::from_string(luaT_tostringview(ref, -1));
+	else if (lua_isnil(ref, -1))
+		return 0;
+	else
+		return _log.fail(EINVAL, "Invalid return value from tll_on_request: not integer and not string");
+
+	long long resp = 0;
+	if (!_response_keys.take(key, time, resp)) {
+		_request_keys.insert(key, time);
+		return 0;
+	}
+	return _report(msg->seq, time, resp);
+}
+
+int LuaMeasure::_match_response(long long seq, const MeasureKey &key, long long time)
+{
+	long long req = 0;
+	if (!_request_keys.take(key, time, req)) {
+		_response_keys.insert(key, time);
+		return 0;
+	}
+	return _report(seq, req, time);
+}
+
 int LuaMeasure::_report(long long seq, long long req, long long resp)
 {
 	int64_t dt = resp - req;
-	_log.info("TIME: RTT {}: {}ns", seq, dt);
+	_log.trace("TIME: RTT {}: {}ns", seq, dt);
 	auto stat = this->stat();
 	if (stat) {
 		auto page = stat->acquire();
 		if (page) {
 			page->rtt = dt;
+			const auto evictions = _evictions_total();
+			page->evict = evictions - _evictions;
+			_evictions = evictions;
 			stat->release(page);
 		}
 	}
+
+	if (_summary) {
+		_histogram.add(dt);
+		if (_summary_count && _histogram.count() >= _summary_count)
+			return _report_summary();
+		return 0; // Interval is checked by timer
+	}
+
 	tll_msg_t msg = { TLL_MESSAGE_DATA };
 	std::array<char, quantile_scheme::Data::meta_size()> buf = {};
 	auto data = quantile_scheme::Data::bind(buf);
@@ -186,3 +322,30 @@ int LuaMeasure::_report(long long seq, long long req, long long resp)
 	_callback_data(&msg);
 	return 0;
 }
+
+int LuaMeasure::_report_summary()
+{
+	_summary_last = tll::time::now();
+	if (!_histogram.count())
+		return 0;
+
+	tll_msg_t msg = { TLL_MESSAGE_DATA };
+	std::array<char, quantile_scheme::Summary::meta_size()> buf = {};
+	auto data = quantile_scheme::Summary::bind(buf);
+	data.set_count(_histogram.count());
+	data.set_min(_histogram.min());
+	data.set_max(_histogram.max());
+	data.set_p50(_histogram.quantile(0.5));
+	data.set_p90(_histogram.quantile(0.9));
+	data.set_p99(_histogram.quantile(0.99));
+	data.set_p999(_histogram.quantile(0.999));
+	_histogram.reset();
+
+	_log.info("TIME: RTT summary of {} samples: min {}ns, p50 {}ns, p99 {}ns, max {}ns", data.get_count(), data.get_min(), data.get_p50(), data.get_p99(), data.get_max());
+
+	msg.data = buf.data();
+	msg.size = buf.size();
+	msg.msgid = data.meta_id();
+	_callback_data(&msg);
+	return 0;
+}
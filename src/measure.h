@@ -3,6 +3,13 @@
 
 #include <tll/channel/tagged.h>
 
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "histogram.h"
 #include "tll/lua/base.h"
 
 namespace tll::lua {
@@ -11,18 +18,253 @@ using tll::channel::Input;
 using tll::channel::Output;
 using tll::channel::TaggedChannel;
 
+/**
+ * Fixed size seq -> time table indexed by low bits of seq
+ *
+ * Sequence numbers are mostly monotonic so consecutive entries occupy different slots, entry is
+ * evicted when newer seq maps into the same slot. No allocation is done after resize.
+ */
+class SeqWindow
+{
+	struct Slot
+	{
+		long long seq;
+		long long time;
+		bool used;
+	};
+
+	std::vector<Slot> _slots;
+	size_t _mask = 0;
+	size_t _size = 0;
+
+ public:
+	size_t evictions = 0;
+
+	void resize(size_t capacity)
+	{
+		size_t s = 1;
+		while (s < capacity)
+			s <<= 1;
+		_slots.assign(s, Slot {});
+		_mask = s - 1;
+		_size = 0;
+		evictions = 0;
+	}
+
+	void clear()
+	{
+		for (auto & s : _slots)
+			s.used = false;
+		_size = 0;
+	}
+
+	size_t size() const { return _size; }
+
+	void insert(long long seq, long long time)
+	{
+		auto & s = _slots[seq & _mask];
+		if (!s.used)
+			_size++;
+		else if (s.seq != seq)
+			evictions++;
+		s = { seq, time, true };
+	}
+
+	/// Remove entry for seq, returns false if it is not stored
+	bool take(long long seq, long long &time)
+	{
+		auto & s = _slots[seq & _mask];
+		if (!s.used || s.seq != seq)
+			return false;
+		time = s.time;
+		s.used = false;
+		_size--;
+		return true;
+	}
+};
+
+/// 128-bit correlation key made from integer or string
+struct MeasureKey
+{
+	uint64_t lo = 0;
+	uint64_t hi = 0;
+
+	bool operator == (const MeasureKey &rhs) const { return lo == rhs.lo && hi == rhs.hi; }
+
+	static MeasureKey from_int(long long v) { return { (uint64_t) v, 0 }; }
+
+	/// Strings up to 15 bytes are stored as is with length in last byte, longer ones are hashed
+	static MeasureKey from_string(std::string_view s)
+	{
+		MeasureKey k;
+		unsigned char buf[16] = {};
+		if (s.size() < sizeof(buf)) {
+			memcpy(buf, s.data(), s.size());
+			buf[15] = s.size();
+		} else {
+			uint64_t h = 14695981039346656037ull; // FNV-1a
+			for (auto c : s)
+				h = (h ^ (unsigned char) c) * 1099511628211ull;
+			const uint64_t lo = std::hash<std::string_view> {}(s);
+			memcpy(buf, &lo, sizeof(lo));
+			memcpy(buf + 8, &h, sizeof(h));
+			buf[15] = 0xff;
+		}
+		memcpy(&k.lo, buf, 8);
+		memcpy(&k.hi, buf + 8, 8);
+		return k;
+	}
+
+	size_t hash() const { return (lo ^ (hi * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull; }
+};
+
+/**
+ * Fixed size open addressing key -> time table with TTL
+ *
+ * Probe length is limited so operations are O(1): if there is no free, deleted or expired slot
+ * in probe range then the oldest entry is evicted. Entries older than ``ttl`` relative to the time
+ * of current operation are treated as free.
+ */
+class KeyWindow
+{
+	enum class State : unsigned char { Empty, Used, Deleted };
+	struct Slot
+	{
+		MeasureKey key;
+		long long time;
+		State state;
+	};
+
+	std::vector<Slot> _slots;
+	size_t _mask = 0;
+	size_t _size = 0;
+
+ public:
+	static constexpr size_t probe_max = 32;
+
+	long long ttl = 0; ///< Entry lifetime in ns, disabled if zero
+	size_t evictions = 0;
+
+	void resize(size_t capacity)
+	{
+		size_t s = probe_max;
+		while (s < capacity)
+			s <<= 1;
+		_slots.assign(s, Slot {});
+		_mask = s - 1;
+		_size = 0;
+		evictions = 0;
+	}
+
+	void clear()
+	{
+		for (auto & s : _slots)
+			s.state = State::Empty;
+		_size = 0;
+	}
+
+	size_t size() const { return _size; }
+
+	void insert(const MeasureKey &key, long long time)
+	{
+		Slot * free = nullptr;
+		Slot * oldest = nullptr;
+		const auto h = key.hash();
+		for (size_t i = 0; i < probe_max; i++) {
+			auto & s = _slots[(h + i) & _mask];
+			if (s.state == State::Empty) {
+				if (!free)
+					free = &s;
+				break;
+			}
+			if (s.state == State::Deleted) {
+				if (!free)
+					free = &s;
+				continue;
+			}
+			if (s.key == key) { // Replace duplicate
+				s.time = time;
+				return;
+			}
+			if (_expired(s, time)) {
+				s.state = State::Deleted;
+				_size--;
+				evictions++;
+				if (!free)
+					free = &s;
+				continue;
+			}
+			if (!oldest || s.time < oldest->time)
+				oldest = &s;
+		}
+		if (!free) {
+			free = oldest;
+			_size--;
+			evictions++;
+		}
+		*free = { key, time, State::Used };
+		_size++;
+	}
+
+	/// Remove entry for key, returns false if it is not stored or is expired
+	bool take(const MeasureKey &key, long long now, long long &time)
+	{
+		const auto h = key.hash();
+		for (size_t i = 0; i < probe_max; i++) {
+			auto & s = _slots[(h + i) & _mask];
+			if (s.state == State::Empty)
+				return false;
+			if (s.state != State::Used || !(s.key == key))
+				continue;
+			s.state = State::Deleted;
+			_size--;
+			if (_expired(s, now)) {
+				evictions++;
+				return false;
+			}
+			time = s.time;
+			return true;
+		}
+		return false;
+	}
+
+ private:
+	bool _expired(const Slot &s, long long now) const { return ttl && now - s.time > ttl; }
+};
+
 class LuaMeasure : public LuaBase<LuaMeasure, tll::channel::Tagged<LuaMeasure, Input, Output>>
 {
 	using Base = LuaBase<LuaMeasure, tll::channel::Tagged<LuaMeasure, Input, Output>>;
 
-	std::map<long long, long long> _response_time; // seq -> timestamp
-	std::map<long long, long long> _request_time; // seq -> timestamp
+	SeqWindow _response_time; // seq -> timestamp
+	SeqWindow _request_time; // seq -> timestamp
+
+	size_t _window = 10000; // Amount of stored entries, rounded up to power of 2
+	size_t _evictions = 0; // Evictions already reported in stat
+
+	KeyWindow _response_keys; // Used when tll_on_request is defined
+	KeyWindow _request_keys;
+	size_t _key_window = 500000;
+	tll::duration _key_ttl = {};
+
+	size_t _evictions_total() const
+	{
+		return _request_time.evictions + _response_time.evictions + _request_keys.evictions + _response_keys.evictions;
+	}
 
-	size_t _map_size = 10000; // Amount of stored entries
+	bool _summary = false; // Report quantile summary instead of message per sample
+	Histogram _histogram;
+	tll::duration _summary_interval = std::chrono::seconds(1);
+	size_t _summary_count = 0; // Report summary after given number of samples, disabled if zero
+	tll::time_point _summary_last = {};
+	std::unique_ptr<tll::Channel> _summary_timer; // Reports summary when there are no new samples
 
 	int _output_time_msgid = -1;
 
 	bool _manual_open = false;
+
+	Hook _on_data = { "tll_on_data" };
+	Hook _on_request = { "tll_on_request" }; ///< Key for output messages, enables key based correlation
  public:
 	static constexpr std::string_view channel_protocol() { return "lua-measure"; }
 	static constexpr auto open_policy() { return OpenPolicy::Manual; }
@@ -31,17 +273,39 @@ class LuaMeasure : public LuaBase<LuaMeasure, tll::channel::Tagged<LuaMeasure, I
 	struct StatType : public Base::StatType
 	{
 		tll::stat::IntegerGroup<tll::stat::Ns, 'r', 't', 't'> rtt;
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'e', 'v', 'i', 'c', 't'> evict;
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'u', 'n', 'm', 'a', 't', 'c', 'h'> unmatch;
 	};
 	tll::stat::BlockT<StatType> * stat() { return static_cast<tll::stat::BlockT<StatType> *>(this->internal.stat); }
 
 	int _init(const tll::Channel::Url &, tll::Channel *master);
 	int _open(const tll::ConstConfig &props);
 	int _close();
+	void _free();
 
 	int callback_tag(TaggedChannel<Input> * c, const tll_msg_t *msg);
 	int callback_tag(TaggedChannel<Output> * c, const tll_msg_t *msg);
 
 	int _report(long long seq, long long req, long long resp);
+	int _report_summary();
+	static int _on_summary_timer(const tll_channel_t *, const tll_msg_t *, void * user);
+
+	int _on_request_msg(TaggedChannel<Output> * c, const tll_msg_t *msg, long long time);
+	int _match_response(long long seq, const MeasureKey &key, long long time);
+
+	int _lua_hooks_bind(lua_State * lua)
+	{
+		_on_data.bind(lua);
+		_on_request.bind(lua);
+		return Base::_lua_hooks_bind(lua);
+	}
+
+	void _lua_hooks_reset(lua_State * lua)
+	{
+		_on_data.reset(lua);
+		_on_request.reset(lua);
+		Base::_lua_hooks_reset(lua);
+	}
 };
 
 } // namespace tll::lua
@@ -57,22 +57,10 @@ int LuaPrefix::_open(const tll::ConstConfig &props)
 	lua_pushcclosure(_lua, _lua_post, 1);
 	lua_setglobal(_lua, "tll_child_post");
 
-	_on_data_name = "";
+	_on_data_hook.name = "";
 	lua_getglobal(_lua, "tll_on_data");
 	if (lua_isfunction(_lua, -1))
-		_on_data_name = "tll_on_data";
-	lua_pop(_lua, 1);
-
-	lua_getglobal(_lua, "tll_on_control");
-	_with_on_control = lua_isfunction(_lua, -1);
-	lua_pop(_lua, 1);
-
-	lua_getglobal(_lua, "tll_on_post");
-	_with_on_post = lua_isfunction(_lua, -1);
-	lua_pop(_lua, 1);
-
-	lua_getglobal(_lua, "tll_on_post_control");
-	_with_on_post_control = lua_isfunction(_lua, -1);
+		_on_data_hook.name = "tll_on_data";
 	lua_pop(_lua, 1);
 
 	lua_getglobal(_lua, "tll_filter");
@@ -94,12 +82,17 @@ int LuaPrefix::_open(const tll::ConstConfig &props)
 		return _log.fail(EINVAL, "Unknown tll_prefix_mode: {}, has to be one of 'filter' or 'normal'", mode);
 	lua_pop(_lua, 1);
 
-	if (_mode == Mode::Filter && _on_data_name.empty()) {
+	if (_mode == Mode::Filter && _on_data_hook.name.empty()) {
 		if (!with_filter)
 			return _log.fail(EINVAL, "No 'tll_filter' function in filter mode");
-		_on_data_name = "tll_filter";
+		_on_data_hook.name = "tll_filter";
 	}
 
+	_lua_hooks_bind(_lua);
+
+	if (_mode == Mode::Filter) // Filter result is needed for each message
+		_batch_enabled = false;
+
 	luaT_push<tll::lua::Channel>(_lua, { self(), &_encoder });
 	lua_setglobal(_lua, "tll_self");
 
@@ -137,6 +130,23 @@ int LuaPrefix::_on_active()
 		lua_setglobal(_lua, "tll_child_scheme");
 	}
 
+	_index.add(_scheme.get());
+	_index.add(_scheme_child.get());
+	_index.add(_scheme_control.get());
+	_index.add(_child->scheme(TLL_MESSAGE_CONTROL));
+
+	if (_mode == Mode::Normal) {
+		if (auto r = _lua_handlers_build(_scheme_child.get()); r)
+			return r;
+	}
+
+	if (_shards) {
+		if (_on_data_hook.name.empty() && _handlers.empty())
+			return _log.fail(EINVAL, "Sharded mode needs tll_on_data, tll_filter or per-message tll_on_data_<Name> functions");
+		if (auto r = _shard_start(_on_data_hook.name, _mode == Mode::Filter, _mode == Mode::Normal, _scheme_child.get(), _child.get()); r)
+			return r;
+	}
+
 	lua_getglobal(_lua, "tll_on_active");
 	if (lua_isfunction(_lua, -1)) {
 		auto ref = _lua.copy();
@@ -149,28 +159,33 @@ int LuaPrefix::_on_active()
 	return Base::_on_active();
 }
 
-int LuaPrefix::_on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, const tll::Channel * channel, std::string_view func, bool filter)
+int LuaPrefix::_on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, const tll::Channel * channel, const Hook &hook, bool filter)
 {
 	auto ref = _lua.copy();
 	auto guard = StackGuard(ref);
+	auto scope = _reflection_pool.scope();
+	const auto kind = filter ? HookKind::Filter : channel == self() ? HookKind::Post : HookKind::Data;
+	const auto start = _hook_start();
 
-	lua_getglobal(ref, func.data());
-	auto args = _lua_pushmsg(msg, scheme, channel, true);
-	if (args < 0) {
+	hook.push(ref);
+	auto r = luaT_pcallpush(ref, 1, [&](lua_State * lua) { return _lua_pushmsg(lua, msg, scheme, channel, true); });
+	if (r < 0) {
 		if (_fragile)
 			state(tll::state::Error);
 		return EINVAL;
 	}
-	//luaT_push(ref, msg);
-	if (lua_pcall(ref, args, 1, 0)) {
-		auto text = fmt::format("Lua function {} failed: {}\n  on", func, lua_tostring(ref, -1));
+	if (r) {
+		auto text = fmt::format("Lua function {} failed: {}\n  on", hook.name, lua_tostring(ref, -1));
 		const auto level = _fragile ? tll::logger::Error : tll::logger::Warning;
 		tll_channel_log_msg(channel, _log.name(), level, _dump_error, msg, text.data(), text.size());
+		_lua_stat(kind, start, true);
 		if (_fragile)
 			state(tll::state::Error);
 		return EINVAL;
 	}
 
+	_lua_stat(kind, start);
+
 	if (filter) {
 		auto r = lua_toboolean(ref, -1);
 		if (r)
@@ -22,16 +22,14 @@ class LuaPrefix : public tll::lua::LuaBase<LuaPrefix, tll::channel::Prefix<LuaPr
 	tll::scheme::ConstSchemePtr _scheme_control_child;
 	tll::scheme::ConstSchemePtr _scheme_control_init;
 
-	bool _with_on_post = false;
-	bool _with_on_post_control = false;
-	bool _with_on_control = false;
-	std::string _on_data_name;
+	tll::lua::Hook _on_data_hook; ///< tll_on_data or tll_filter, empty name if not defined
+	tll::lua::Hook _on_control = { "tll_on_control" };
+	tll::lua::Hook _on_post = { "tll_on_post" };
+	tll::lua::Hook _on_post_control = { "tll_on_post_control" };
 
 	enum class Mode { Normal, Filter };
 	Mode _mode = Mode::Normal;
 
-	bool _fragile = false;
-
 	tll::Config _open_cfg;
 
 public:
@@ -62,16 +60,34 @@ public:
 
 	int _on_data(const tll_msg_t *msg)
 	{
-		if (_on_data_name.empty())
+		if (!_shard_workers.empty())
+			return _shard_push(msg, _scheme_child.get(), _child.get());
+		if (_batch_enabled)
+			return _batch_push(msg, _scheme_child.get(), _child.get());
+		if (auto h = _handlers.lookup(msg->msgid); h) {
+			_on_msg(msg, _scheme_child.get(), _child.get(), *h);
+			return 0;
+		}
+		if (!_on_data_hook)
 			return Base::_on_data(msg);
-		_on_msg(msg, _scheme_child.get(), _child.get(), _on_data_name, _mode == Mode::Filter);
+		_on_msg(msg, _scheme_child.get(), _child.get(), _on_data_hook, _mode == Mode::Filter);
 		return 0;
 	}
 
 	int _on_other(const tll_msg_t *msg)
 	{
-		if (msg->type == TLL_MESSAGE_CONTROL && _with_on_control) {
-			_on_msg(msg, _child->scheme(TLL_MESSAGE_CONTROL), _child.get(), "tll_on_control");
+		// Keep ordering with data messages still processed in shards, state changes are not delayed
+		if (msg->type != TLL_MESSAGE_STATE && _shard_defer(msg))
+			return 0;
+		return _on_other_deliver(msg);
+	}
+
+	int _on_other_deliver(const tll_msg_t *msg)
+	{
+		if (!_batch.empty())
+			_batch_flush();
+		if (msg->type == TLL_MESSAGE_CONTROL && _on_control) {
+			_on_msg(msg, _child->scheme(TLL_MESSAGE_CONTROL), _child.get(), _on_control);
 			return 0;
 		}
 		return Base::_on_other(msg);
@@ -79,14 +95,14 @@ public:
 
 	int _post(const tll_msg_t *msg, int flags)
 	{
-		if (!_with_on_post)
+		if (!_on_post)
 			return Base::_post(msg, flags);
 		if (msg->type != TLL_MESSAGE_DATA) {
-			if (_with_on_post_control)
-				return _on_msg(msg, _scheme_control.get(), self(), "tll_on_post_control");
+			if (_on_post_control)
+				return _on_msg(msg, _scheme_control.get(), self(), _on_post_control);
 			return Base::_post(msg, flags);
 		}
-		if (_on_msg(msg, _scheme.get(), self(), "tll_on_post"))
+		if (_on_msg(msg, _scheme.get(), self(), _on_post))
 			return EINVAL;
 		return 0;
 	}
@@ -94,7 +110,9 @@ public:
 	static int _lua_post(lua_State * lua)
 	{
 		if (auto self = _lua_self(lua, 1); self) {
+			const auto start = self->_hook_start();
 			auto msg = self->_encoder.encode_stack(lua, self->_scheme_child.get(), self->_child.get(), 0);
+			self->_encode_stat(start, !msg);
 			if (!msg) {
 				self->_log.error("Failed to convert message: {}", self->_encoder.error);
 				return luaL_error(lua, "Failed to convert message");
@@ -106,7 +124,44 @@ public:
 		return luaL_error(lua, "Non-userdata value in upvalue");
 	}
 
-	int _on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, const tll::Channel *, std::string_view func, bool filter = false);
+	int _on_msg(const tll_msg_t *msg, const tll::Scheme * scheme, const tll::Channel *, const tll::lua::Hook &hook, bool filter = false);
+
+	void _lua_shard_init(lua_State * lua, tll::lua::ShardWorker &worker)
+	{
+		worker.targets[tll::lua::ShardOutput::Post] = { _scheme_child.get(), _child.get() };
+		worker.add_output(lua, "tll_child_post", tll::lua::ShardOutput::Post);
+	}
+
+	void _shard_output(int target, const tll_msg_t * msg)
+	{
+		if (target == tll::lua::ShardOutput::Pass)
+			_callback_data(msg);
+		else if (target == tll::lua::ShardOutput::Post)
+			_child->post(msg);
+		else if (target == tll::lua::ShardOutput::Other)
+			_on_other_deliver(msg);
+		else
+			Base::_shard_output(target, msg);
+	}
+
+	int _lua_hooks_bind(lua_State * lua)
+	{
+		if (!_on_data_hook.name.empty())
+			_on_data_hook.bind(lua);
+		_on_control.bind(lua);
+		_on_post.bind(lua);
+		_on_post_control.bind(lua);
+		return Base::_lua_hooks_bind(lua);
+	}
+
+	void _lua_hooks_reset(lua_State * lua)
+	{
+		_on_data_hook.reset(lua);
+		_on_control.reset(lua);
+		_on_post.reset(lua);
+		_on_post_control.reset(lua);
+		Base::_lua_hooks_reset(lua);
+	}
 
 	/// Initialize control scheme
 	int _init_control(const tll::Scheme * child);
@@ -5,7 +5,7 @@
 
 namespace quantile_scheme {
 
-static constexpr std::string_view scheme_string = R"(yamls+gz://eJxdjDEKgDAQBHtfsd01CgoiktqPRIxyoEkwpyCSv5uAhVjtDLtsBas3o0CDFk0FwJNCUyeY2axTUImACvc7y0El5PLZxktMn9R5YWeDwk25oVQF2dkuFOPv4NTr8Xk42ErXUiwegFYoUQ==)";
+static constexpr std::string_view scheme_string = R"(yamls+gz://eNq1zk0KwjAQBeB9TjG72RioomKz9gY9QbRRAk1amokYSu5uAhZ/qLQbVzPD+xgeByuNEoBHSRIZgK4FrIu0XLRqaifSBsBheLI8cAUUunydAqlDOtuOdGudgAFzgily1Gt7xRi/Htxk498+eG1pv8XIGB+bVN4Y2YexzOaPZc6ttzRR5lMZbV/mB5H3OdLtillSLiDlAjJhHoTni3M=)";
 
 struct Data
 {
@@ -35,4 +35,56 @@ struct Data
 	static binder_type<Buf> bind(Buf &buf, size_t offset = 0) { return binder_type<Buf>(tll::make_view(buf).view(offset)); }
 };
 
+struct Summary
+{
+	static constexpr size_t meta_size() { return 64; }
+	static constexpr std::string_view meta_name() { return "Summary"; }
+	static constexpr int meta_id() { return 20; }
+
+	template <typename Buf>
+	struct binder_type : public tll::scheme::Binder<Buf>
+	{
+		using tll::scheme::Binder<Buf>::Binder;
+
+		static constexpr auto meta_size() { return Summary::meta_size(); }
+		static constexpr auto meta_name() { return Summary::meta_name(); }
+		static constexpr auto meta_id() { return Summary::meta_id(); }
+		void view_resize() { this->_view_resize(meta_size()); }
+
+		std::string_view get_name() const { return this->template _get_bytestring<8>(0); }
+		void set_name(std::string_view v) { return this->template _set_bytestring<8>(0, v); }
+
+		using type_count = uint64_t;
+		type_count get_count() const { return this->template _get_scalar<type_count>(8); }
+		void set_count(type_count v) { return this->template _set_scalar<type_count>(8, v); }
+
+		using type_min = int64_t;
+		type_min get_min() const { return this->template _get_scalar<type_min>(16); }
+		void set_min(type_min v) { return this->template _set_scalar<type_min>(16, v); }
+
+		using type_max = int64_t;
+		type_max get_max() const { return this->template _get_scalar<type_max>(24); }
+		void set_max(type_max v) { return this->template _set_scalar<type_max>(24, v); }
+
+		using type_p50 = int64_t;
+		type_p50 get_p50() const { return this->template _get_scalar<type_p50>(32); }
+		void set_p50(type_p50 v) { return this->template _set_scalar<type_p50>(32, v); }
+
+		using type_p90 = int64_t;
+		type_p90 get_p90() const { return this->template _get_scalar<type_p90>(40); }
+		void set_p90(type_p90 v) { return this->template _set_scalar<type_p90>(40, v); }
+
+		using type_p99 = int64_t;
+		type_p99 get_p99() const { return this->template _get_scalar<type_p99>(48); }
+		void set_p99(type_p99 v) { return this->template _set_scalar<type_p99>(48, v); }
+
+		using type_p999 = int64_t;
+		type_p999 get_p999() const { return this->template _get_scalar<type_p999>(56); }
+		void set_p999(type_p999 v) { return this->template _set_scalar<type_p999>(56, v); }
+	};
+
+	template <typename Buf>
+	static binder_type<Buf> bind(Buf &buf, size_t offset = 0) { return binder_type<Buf>(tll::make_view(buf).view(offset)); }
+};
+
 } // namespace quantile_scheme
@@ -9,17 +9,30 @@
 
 #include <tll/channel/tcp.h>
 #include <tll/channel/tcp.hpp>
+#include <tll/util/size.h>
 
+#include <cstring>
+#include <optional>
+
+#include "tll/lua/alloc.h"
+#include "tll/lua/frame.h"
+#include "tll/lua/gc.h"
 #include "tll/lua/luat.h"
 #include "tll/lua/message.h"
+#include "tll/lua/profile.h"
 
 using namespace tll;
 using namespace tll::lua;
 
 struct Common
 {
+	Allocator alloc; // Declared before state so it outlives it
 	std::unique_ptr<lua_State, decltype(&lua_close)> lua = { nullptr, lua_close };
+	GcPolicy gc;
+	std::unique_ptr<Profiler> profiler;
+	std::string profile_file;
 	size_t frame_size = 0;
+	std::optional<FrameFormat> frame; // Native framing, declared with frame_format
 
 	std::string code;
 };
@@ -35,6 +48,19 @@ class LuaCommon : public T
 	int _init_lua(const tll::Channel::Url &url, tll::Channel * master);
 	int _open_lua();
 
+	static int _lua_profile_dump(lua_State * lua)
+	{
+		auto common = static_cast<Common *>(lua_touserdata(lua, lua_upvalueindex(1)));
+		if (!common)
+			return luaL_error(lua, "Non-userdata value in upvalue");
+		if (!common->profiler)
+			return luaL_error(lua, "Profiler is disabled");
+		auto filename = luaL_optstring(lua, 1, common->profile_file.c_str());
+		if (auto r = common->profiler->dump(filename); r)
+			return luaL_error(lua, "Failed to write profile into '%s': %s", filename, strerror(r));
+		return 0;
+	}
+
 	int _init(const tll::Channel::Url &url, tll::Channel *master)
 	{
 		this->_log.info("Common init {}", this->channelT()->lua_hooks);
@@ -58,6 +84,10 @@ class LuaCommon : public T
 	int _close()
 	{
 		if (this->channelT()->lua_hooks) {
+			if (this->_common && this->_common->lua && this->_common->profiler) {
+				if (auto r = this->_common->profiler->dump(this->_common->profile_file); r)
+					this->_log.error("Failed to write profile into '{}': {}", this->_common->profile_file, strerror(r));
+			}
 			if (this->_common)
 				this->_common->lua.reset();
 		} else
@@ -78,6 +108,12 @@ class LuaSocket : public LuaCommon<tll::channel::TcpSocket<T>>
  public:
 	static constexpr std::string_view param_prefix() { return "tcp"; }
 
+	struct StatType : public tll::channel::TcpSocket<T>::StatType
+	{
+		tll::stat::IntegerGroup<tll::stat::Ns, 'g', 'c'> gc;
+	};
+	tll::stat::BlockT<StatType> * stat() { return static_cast<tll::stat::BlockT<StatType> *>(this->internal.stat); }
+
 	int _post(const tll_msg_t *msg, int flags);
 	int _process(long timeout, int flags);
 
@@ -159,17 +195,35 @@ int LuaCommon<T>::_init_lua(const tll::Channel::Url &url, tll::Channel *master)
 {
 	auto reader = this->channel_props_reader(url);
 	auto code = reader.template getT<std::string>("code");
+	auto mode = reader.getT("allocator", Allocator::Mode::Libc, {{"libc", Allocator::Mode::Libc}, {"pool", Allocator::Mode::Pool}});
+	auto limit = reader.getT("memory-limit", tll::util::Size { 0 });
+	auto gc = reader.getT("gc", GcPolicy::Mode::Auto, {{"auto", GcPolicy::Mode::Auto}, {"idle", GcPolicy::Mode::Idle}, {"manual", GcPolicy::Mode::Manual}});
+	auto gc_step = reader.getT("gc-step", 0);
+	auto gc_pause = reader.getT("gc-pause", 200);
+	auto profile = reader.getT("profile", false);
+	auto profile_interval = reader.getT("profile-interval", 10000u);
+	auto profile_file = reader.getT("profile-file", fmt::format("{}.folded", this->_log.name()));
 	if (!reader)
 		return this->_log.fail(EINVAL, "Invalid url: {}", reader.error());
 	_common.reset(new Common);
 	_common->code = code;
+	_common->alloc.mode = mode;
+	_common->alloc.limit = limit;
+	_common->gc.mode = gc;
+	_common->gc.step = gc_step;
+	_common->gc.pause = gc_pause;
+	if (profile) {
+		_common->profiler.reset(new Profiler);
+		_common->profiler->interval = profile_interval;
+		_common->profile_file = profile_file;
+	}
 	return 0;
 }
 
 template <typename T>
 int LuaCommon<T>::_open_lua()
 {
-	std::unique_ptr<lua_State, decltype(&lua_close)> lua_ptr(luaL_newstate(), lua_close);
+	std::unique_ptr<lua_State, decltype(&lua_close)> lua_ptr(this->_common->alloc.newstate(), lua_close);
 	auto lua = lua_ptr.get();
 	if (!lua)
 		return this->_log.fail(EINVAL, "Failed to create lua state");
@@ -190,13 +244,45 @@ int LuaCommon<T>::_open_lua()
 	if (lua_pcall(lua, 0, 0, 0))
 		return this->_log.fail(EINVAL, "Failed to init globals: {}", lua_tostring(lua, -1));
 
+	this->_common->frame.reset();
+	lua_getglobal(lua, "frame_format");
+	if (!lua_isnil(lua, -1)) {
+		if (lua_type(lua, -1) != LUA_TSTRING)
+			return this->_log.fail(EINVAL, "Invalid frame_format: expected string");
+		auto format = luaT_tostringview(lua, -1);
+		FrameFormat frame;
+		if (frame.init(format))
+			return this->_log.fail(EINVAL, "Invalid frame_format '{}': {}", format, frame.error);
+		lua_getglobal(lua, "frame_fields");
+		if (frame.bind(lua, -1))
+			return this->_log.fail(EINVAL, "Invalid frame_fields for '{}': {}", format, frame.error);
+		this->_log.info("Native frame format '{}'", format);
+		this->_common->frame = std::move(frame);
+	}
+	lua_settop(lua, 0);
+
 	lua_getglobal(lua, "frame_size");
 	auto size = lua_tointeger(lua, -1);
+	lua_pop(lua, 1);
+	if (auto & frame = this->_common->frame; frame) {
+		if (size && (size_t) size != frame->size)
+			return this->_log.fail(EINVAL, "Frame size {} does not match frame_format size {}", size, frame->size);
+		size = frame->size;
+	}
 	if (size <= 0 || size > 64)
 		return this->_log.fail(EINVAL, "Invalid frame size: {}", size);
 	this->_log.info("Lua frame size: {}", size);
 	this->_common->frame_size = size;
 
+	if (auto & p = this->_common->profiler; p) {
+		p->clear();
+		p->attach(lua);
+	}
+
+	lua_pushlightuserdata(lua, this->_common.get());
+	lua_pushcclosure(lua, _lua_profile_dump, 1);
+	lua_setglobal(lua, "tll_profile_dump");
+	this->_common->gc.init(lua);
 	this->_common->lua.reset(lua_ptr.release());
 	return 0;
 }
@@ -207,10 +293,18 @@ int LuaSocket<T>::_post(const tll_msg_t *msg, int flags)
 	if (msg->type != TLL_MESSAGE_DATA)
 		return 0;
 
+	if (auto & frame = this->_common->frame; frame) {
+		char buf[64];
+		if (frame->pack(msg, buf))
+			return this->_log.fail(ERANGE, "Message fields do not fit into frame, size {}", msg->size);
+		if (auto r = this->_sendv(std::string_view(buf, frame->size), *msg); r)
+			return this->_log.fail(r, "Failed to post data");
+		return 0;
+	}
+
 	auto lua = this->_common->lua.get();
 	lua_getglobal(lua, "frame_pack");
-	luaT_push(lua, msg);
-	if (lua_pcall(lua, 1, 1, 0))
+	if (luaT_pcallpush(lua, 1, [msg](lua_State * lua) { luaT_push(lua, msg); return 1; }))
 		return this->_log.fail(EINVAL, "Frame pack failed: {}", lua_tostring(lua, -1));
 	auto frame = luaT_tostringview(lua, -1);
 
@@ -235,21 +329,28 @@ int LuaSocket<T>::_pending()
 
 		_pending_msg = {};
 
-		auto lua = this->_common->lua.get();
-		lua_getglobal(lua, "frame_unpack");
-		lua_pushlstring(lua, frame, frame_size);
-		luaT_push(lua, &_pending_msg);
-		if (lua_pcall(lua, 2, 1, 0))
-			return this->_log.fail(EINVAL, "Failed to unpack frame: {}", lua_tostring(lua, -1));
-		lua_pop(lua, 1);
+		if (auto & native = this->_common->frame; native) {
+			native->unpack(frame, &_pending_msg);
+		} else {
+			auto lua = this->_common->lua.get();
+			lua_getglobal(lua, "frame_unpack");
+			auto r = luaT_pcallpush(lua, 1, [&](lua_State * lua) {
+				lua_pushlstring(lua, frame, frame_size);
+				luaT_push(lua, &_pending_msg);
+				return 2;
+			});
+			if (r)
+				return this->_log.fail(EINVAL, "Failed to unpack frame: {}", lua_tostring(lua, -1));
+			lua_pop(lua, 1);
+		}
+		if (_pending_msg.size > this->_rbuf.capacity() - frame_size) // Also catches negative sizes
+			return this->_log.fail(EMSGSIZE, "Message size {} too large", _pending_msg.size);
 		_pending_unpacked = true;
 	}
 
 	// Check for pending data
 	auto data = this->template rdataT<char>(frame_size, _pending_msg.size);
 	if (!data) {
-		if (frame_size + _pending_msg.size > this->_rbuf.capacity())
-			return this->_log.fail(EMSGSIZE, "Message size {} too large", _pending_msg.size);
 		this->_dcaps_pending(false);
 		return EAGAIN;
 	}
@@ -273,8 +374,18 @@ int LuaSocket<T>::_process(long timeout, int flags)
 	auto s = this->_recv(this->_rbuf.available());
 	if (!s)
 		return EINVAL;
-	if (!*s)
+	if (!*s) { // Socket is drained, spend time on pending garbage
+		auto dt = this->_common->gc.idle(this->_common->lua.get());
+		if (!dt.count())
+			return EAGAIN;
+		if (auto stat = this->channelT()->stat(); stat) {
+			if (auto page = stat->acquire(); page) {
+				page->gc = std::chrono::duration_cast<std::chrono::nanoseconds>(dt).count();
+				stat->release(page);
+			}
+		}
 		return EAGAIN;
+	}
 	this->_log.debug("Got {} bytes of data", *s);
 	return this->_pending();
 }
@@ -315,6 +315,64 @@ TEST(Lua, Reflection)
 	//ASSERT_LUA_VALUE(lua, out, out.ptr[0].d, "p.0.d");
 }
 
+TEST(Lua, ReflectionCache)
+{
+	tll::scheme::SchemePtr scheme(tll::Scheme::load(SCHEME));
+
+	ASSERT_TRUE(scheme);
+
+	auto message = lookup(scheme.get(), "outer");
+
+	ASSERT_NE(message, nullptr);
+
+	auto lua_ptr = prepare_lua();
+	auto lua = lua_ptr.get();
+	ASSERT_NE(lua, nullptr);
+
+	Settings settings = ::settings;
+	settings.reflection_cache = true;
+	reflection::Pool pool;
+
+	generated::outer data[2] = {};
+	data[0].s.i32 = 10;
+	data[0].l_size = 1;
+	data[0].l[0].d = 1.5;
+	data[1].s.i32 = 20;
+	data[1].l_size = 1;
+	data[1].l[0].d = 2.5;
+
+	const void * ptr[3] = {};
+	for (auto i = 0; i < 4; i++) {
+		auto & v = data[i % 2];
+		tll_msg_t m = {};
+		m.data = &v;
+		m.size = sizeof(v);
+
+		auto scope = pool.scope();
+		pool.push(lua, reflection::Message { message, tll::make_view<const tll_msg_t>(m), settings });
+		lua_getfield(lua, -1, "s");
+		lua_getfield(lua, -1, "i32");
+		ASSERT_EQ(lua_tointeger(lua, -1), v.s.i32);
+		lua_pop(lua, 1);
+
+		lua_getfield(lua, -2, "l");
+		lua_geti(lua, -1, 1);
+		lua_getfield(lua, -1, "d");
+		ASSERT_EQ(lua_tonumber(lua, -1), v.l[0].d);
+		lua_pop(lua, 1);
+
+		const void * current[3] = { lua_topointer(lua, -4), lua_topointer(lua, -3), lua_topointer(lua, -1) };
+		if (i) {
+			// Same userdata objects are reused for each message
+			ASSERT_EQ(ptr[0], current[0]);
+			ASSERT_EQ(ptr[1], current[1]);
+			ASSERT_EQ(ptr[2], current[2]);
+		}
+		memcpy(ptr, current, sizeof(ptr));
+		lua_pop(lua, 4);
+	}
+}
+
 TEST(Lua, ReflectionUnion)
 {
 	tll::scheme::SchemePtr scheme(tll::Scheme::load(SCHEME));
@@ -423,6 +481,70 @@ TEST(Lua, ReflectionEnum)
 	ASSERT_LUA_VALUE(lua, value, nullptr, "f0.string");
 }
 
+TEST(Lua, ReflectionIndex)
+{
+	tll::scheme::SchemePtr scheme(tll::Scheme::load(SCHEME));
+
+	ASSERT_TRUE(scheme);
+
+	SchemeIndex index;
+	index.add(scheme.get());
+
+	auto message = lookup(scheme.get(), "simple");
+	ASSERT_NE(message, nullptr);
+
+	auto fields = index.fields(message);
+	ASSERT_NE(fields, nullptr);
+	for (auto f = message->fields; f; f = f->next)
+		ASSERT_EQ(fields->lookup(f->name), f);
+	ASSERT_EQ(fields->lookup("unknown"), nullptr);
+
+	auto bits = index.bits(lookup(scheme.get(), "bits")->fields->type_bits);
+	ASSERT_NE(bits, nullptr);
+	ASSERT_NE(bits->lookup("c"), nullptr);
+	ASSERT_EQ(bits->lookup("c")->offset, 2u);
+	ASSERT_EQ(bits->lookup("d"), nullptr);
+
+	auto enums = index.enums(lookup(scheme.get(), "enum")->fields->type_enum);
+	ASSERT_NE(enums, nullptr);
+	ASSERT_NE(enums->lookup("B"), nullptr);
+	ASSERT_EQ(enums->lookup("B")->value, 20);
+	ASSERT_NE(enums->lookup(10ll), nullptr);
+	ASSERT_EQ(enums->lookup(10ll)->name, "A"sv);
+	ASSERT_EQ(enums->lookup(11ll), nullptr);
+
+	auto lua_ptr = prepare_lua();
+	auto lua = lua_ptr.get();
+	ASSERT_NE(lua, nullptr);
+
+	Settings settings = ::settings;
+	settings.index = &index;
+
+	generated::simple s = {};
+	s.i32 = 0x32323232;
+	s.u64 = 0x8080808080808080;
+	strcpy(s.s16, "string");
+
+	ASSERT_LUA(lua, s, i32);
+	ASSERT_LUA(lua, s, u64);
+	ASSERT_LUA_VALUE(lua, s, std::string_view("string"), "s16");
+	ASSERT_LUA_VALUE(lua, s, nullptr, "unknown");
+
+	lua_gc(lua, LUA_GCCOLLECT, 0); // Cached keys are anchored and survive full collection
+	ASSERT_LUA(lua, s, i32);
+	ASSERT_LUA(lua, s, u64);
+
+	message = lookup(scheme.get(), "bits");
+	generated::bits b = {};
+	b.bits.b(true);
+	ASSERT_LUA_VALUE(lua, b, false, "bits.a");
+	ASSERT_LUA_VALUE(lua, b, true, "bits.b");
+
+	message = lookup(scheme.get(), "enum");
+	uint16_t value = 20;
+	ASSERT_LUA_VALUE(lua, value, std::string_view { "B" }, "f0.string");
+}
+
 TEST(Lua, TimePoint)
 {
 	using namespace std::chrono;
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_ALLOC_H
+#define _TLL_LUA_ALLOC_H
+
+#include "tll/lua/luat.h"
+
+#include <tll/logger.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+namespace tll::lua {
+
+/**
+ * Lua allocator with memory accounting and optional size-class pool
+ *
+ * In ``Pool`` mode small blocks are rounded up to 16 byte classes and reused from thread local
+ * free lists instead of going to libc on each allocation. Allocations that exceed ``limit`` fail
+ * so Lua raises memory error in the script instead of exhausting process memory.
+ */
+class Allocator
+{
+ public:
+	enum class Mode { Libc, Pool };
+
+	Mode mode = Mode::Libc;
+	size_t limit = 0; ///< Hard limit on used memory, unlimited if zero
+
+	size_t in_use = 0; ///< Bytes requested by Lua
+	size_t peak = 0;
+	size_t allocations = 0; ///< Number of new blocks allocated
+
+	static constexpr size_t class_step = 16;
+	static constexpr size_t class_count = 16; ///< Blocks up to 256 bytes are pooled
+	static constexpr size_t class_max = class_step * class_count;
+	static constexpr size_t cache_max = 4096; ///< Free blocks kept per class and thread
+
+	lua_State * newstate()
+	{
+		peak = in_use; // Previous state can be still alive
+		auto lua = lua_newstate(_alloc, this);
+		if (lua)
+			lua_atpanic(lua, _panic);
+		return lua;
+	}
+
+ private:
+	/// Error outside of protected call, Lua aborts after handler returns so leave a trace in the log
+	static int _panic(lua_State * lua)
+	{
+		auto text = lua_type(lua, -1) == LUA_TSTRING ? lua_tostring(lua, -1) : "non-string error";
+		tll::Logger("tll.lua").critical("Unprotected Lua error: {}", text);
+		return 0;
+	}
+
+	struct FreeList
+	{
+		struct Node { Node * next; };
+		Node * head = nullptr;
+		size_t size = 0;
+	};
+
+	struct Pool
+	{
+		std::array<FreeList, class_count> lists;
+
+		Pool() { alive() = true; }
+		~Pool()
+		{
+			alive() = false;
+			for (auto & l : lists) {
+				while (l.head) {
+					auto next = l.head->next;
+					std::free(l.head);
+					l.head = next;
+				}
+			}
+		}
+
+		/// Pool can be already destroyed when state is closed from thread local or static destructors
+		static bool & alive()
+		{
+			static thread_local bool value = false;
+			return value;
+		}
+	};
+
+	static Pool * pool()
+	{
+		static thread_local Pool value;
+		return Pool::alive() ? &value : nullptr;
+	}
+
+	static size_t size_class(size_t size) { return (size - 1) / class_step; }
+
+	static void * _get(size_t size)
+	{
+		if (size > class_max)
+			return std::malloc(size);
+		auto cls = size_class(size);
+		if (auto p = pool(); p) {
+			auto & l = p->lists[cls];
+			if (l.head) {
+				auto r = l.head;
+				l.head = r->next;
+				l.size--;
+				return r;
+			}
+		}
+		return std::malloc((cls + 1) * class_step);
+	}
+
+	static void _put(void * ptr, size_t size)
+	{
+		if (size <= class_max) {
+			if (auto p = pool(); p) {
+				auto & l = p->lists[size_class(size)];
+				if (l.size < cache_max) {
+					auto node = static_cast<FreeList::Node *>(ptr);
+					node->next = l.head;
+					l.head = node;
+					l.size++;
+					return;
+				}
+			}
+		}
+		std::free(ptr);
+	}
+
+	static void * _realloc_pool(void * ptr, size_t osize, size_t nsize)
+	{
+		if (ptr) {
+			if (osize <= class_max && nsize <= class_max && size_class(osize) == size_class(nsize))
+				return ptr;
+			if (osize > class_max && nsize > class_max)
+				return std::realloc(ptr, nsize);
+		}
+		auto r = _get(nsize);
+		if (!r)
+			return nullptr;
+		if (ptr) {
+			memcpy(r, ptr, std::min(osize, nsize));
+			_put(ptr, osize);
+		}
+		return r;
+	}
+
+	static void * _alloc(void * ud, void * ptr, size_t osize, size_t nsize)
+	{
+		auto self = static_cast<Allocator *>(ud);
+		if (!ptr)
+			osize = 0; // Object type for new blocks
+		if (nsize == 0) {
+			if (ptr) {
+				self->in_use -= osize;
+				if (self->mode == Mode::Pool)
+					_put(ptr, osize);
+				else
+					std::free(ptr);
+			}
+			return nullptr;
+		}
+
+		if (self->limit && nsize > osize && self->in_use + nsize - osize > self->limit)
+			return nullptr;
+
+		auto r = self->mode == Mode::Pool ? _realloc_pool(ptr, osize, nsize) : std::realloc(ptr, nsize);
+		if (!r)
+			return nullptr;
+		self->in_use = self->in_use + nsize - osize;
+		self->peak = std::max(self->peak, self->in_use);
+		if (!ptr)
+			self->allocations++;
+		return r;
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_ALLOC_H
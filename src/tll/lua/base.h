@@ -8,16 +8,33 @@
 #ifndef _TLL_LUA_BASE_H
 #define _TLL_LUA_BASE_H
 
+#include "tll/lua/alloc.h"
+#include "tll/lua/batch.h"
+#include "tll/lua/builder.h"
+#include "tll/lua/cache.h"
 #include "tll/lua/channel.h"
+#include "tll/lua/clock.h"
 #include "tll/lua/config.h"
 #include "tll/lua/encoder.h"
+#include "tll/lua/gc.h"
+#include "tll/lua/handlers.h"
+#include "tll/lua/index.h"
 #include "tll/lua/logger.h"
 #include "tll/lua/luat.h"
+#include "tll/lua/patch.h"
+#include "tll/lua/profile.h"
 #include "tll/lua/reflection.h"
 #include "tll/lua/scheme.h"
+#include "tll/lua/shard.h"
 #include "tll/lua/time.h"
 
 #include <tll/channel/base.h>
+#include <tll/util/size.h>
+
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
 
 namespace tll::lua {
 
@@ -30,23 +47,81 @@ class LuaBase : public B
 	std::list<std::string> _preload;
 	std::string _code;
 	std::string _extra_path;
+	bool _code_cache = true; ///< Load compiled chunks from process wide cache
+	std::string _code_cache_dir; ///< Directory for persistent chunk cache, disabled if empty
 	static constexpr tll_channel_log_msg_format_t _dump_error = TLL_MESSAGE_LOG_FRAME;
 
+	Allocator _alloc; ///< Declared before state so it outlives it
+	size_t _alloc_reported = 0; ///< Allocation counter value exported into stat block
+	GcPolicy _gc;
+
+	enum class HookKind { Data, Post, Filter };
+	bool _hook_stat = false; ///< Measure hook and encode latency, only when stat block is enabled
+
+	std::unique_ptr<Profiler> _profiler; ///< Sampling profiler, created only if profiling is enabled
+	std::string _profile_file;
+
+	unsigned _shards = 0; ///< Number of worker threads with separate states, disabled if zero
+	size_t _shard_queue = 1024;
+	enum class ShardKey { MsgId, Addr, Function } _shard_key = ShardKey::MsgId;
+	bool _shard_ordered = true; ///< Deliver results in input order, otherwise only per-shard order is kept
+	Hook _on_shard_key = { "tll_shard_key" };
+	std::vector<std::unique_ptr<ShardWorker>> _shard_workers;
+	uint64_t _shard_sent = 0; ///< Number of messages sent to workers
+	uint64_t _shard_next = 0; ///< Number of delivered results, in ordered mode also order of next result
+	bool _shard_emitting = false;
+	bool _shard_backpressure = true; ///< Suspend source channel when too many messages are in flight
+	tll::Channel * _shard_source = nullptr; ///< Channel that feeds workers, suspended on backpressure
+	bool _shard_suspended = false;
+	std::deque<std::pair<uint64_t, ShardOutput>> _shard_deferred; ///< Non-data messages waiting for preceding results
+
 	LuaRc _lua;
 
 	tll::lua::Encoder _encoder;
 	tll::lua::Settings _settings;
+	tll::lua::SchemeIndex _index; ///< Field/enum/bits lookup tables, filled by derived channels when schemes are known
+	tll::lua::Converter _converter; ///< Used by encoder when native-convert is enabled
+	reflection::Pool _reflection_pool; ///< Reused top level reflection objects, used in reflection-cache mode
+	MessageHandlers _handlers; ///< Per-message tll_on_data_<Name> hooks, filled by derived channels when scheme is known
+
+	bool _fragile = true; ///< Move channel to Error state when hook fails
+
+	BatchBuffer _batch;
+	Hook _on_batch = { "tll_on_data_batch" };
+	bool _batch_enabled = false; ///< Script defines tll_on_data_batch hook and batch-size is not zero
+	size_t _batch_size = 0;
+	tll::duration _batch_delay = {};
 	enum class MessageMode { Auto, Reflection, Binary, Object } _message_mode = MessageMode::Auto;
  public:
 	/// Close policy: perform cleanup in close or leave it to user
 	enum class LuaClosePolicy { Cleanup, Skip };
 	static constexpr auto lua_close_policy() { return LuaClosePolicy::Cleanup; }
 
+	struct StatType : public Base::StatType
+	{
+		tll::stat::Integer<tll::stat::Last, tll::stat::Bytes, 'm', 'e', 'm'> mem;
+		tll::stat::Integer<tll::stat::Max, tll::stat::Bytes, 'm', 'e', 'm', 'm', 'a', 'x'> mem_peak;
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'a', 'l', 'l', 'o', 'c'> alloc;
+		tll::stat::IntegerGroup<tll::stat::Ns, 'g', 'c'> gc;
+		tll::stat::IntegerGroup<tll::stat::Ns, 'r', 'x'> rx; ///< Data hooks: tll_on_data and per-message variants
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'r', 'x', 'e', 'r', 'r'> rxerr;
+		tll::stat::IntegerGroup<tll::stat::Ns, 't', 'x'> tx; ///< tll_on_post hooks
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 't', 'x', 'e', 'r', 'r'> txerr;
+		tll::stat::IntegerGroup<tll::stat::Ns, 'f', 'i', 'l', 't', 'e', 'r'> filter;
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'f', 'e', 'r', 'r'> ferr;
+		tll::stat::IntegerGroup<tll::stat::Ns, 'e', 'n', 'c'> enc; ///< Message encoding in tll_callback and similar functions
+		tll::stat::Integer<tll::stat::Sum, tll::stat::Unknown, 'e', 'n', 'c', 'e', 'r', 'r'> encerr;
+		tll::stat::IntegerGroup<tll::stat::Unknown, 'q', 'u', 'e', 'u', 'e'> queue; ///< Messages in flight to shard workers
+	};
+	tll::stat::BlockT<StatType> * stat() { return static_cast<tll::stat::BlockT<StatType> *>(this->internal.stat); }
+
 	int _init(const tll::Channel::Url &url, tll::Channel *master)
 	{
 		auto reader = this->channel_props_reader(url);
 		_code = reader.template getT<std::string>("code");
 		_extra_path = reader.template getT<std::string>("path", "");
+		_code_cache = reader.getT("code-cache", true);
+		_code_cache_dir = reader.template getT<std::string>("code-cache-dir", "");
 		auto scheme_control = reader.get("scheme-control");
 		enum Preset { Filter, Convert, ConvertFast };
 		auto preset = reader.getT("preset", Convert, {{"filter", Filter}, {"convert", Convert}, {"convert-fast", ConvertFast}});
@@ -80,15 +155,51 @@ class LuaBase : public B
 		_settings.fixed_mode = reader.getT("fixed-mode", _settings.fixed_mode);
 		_settings.decimal128_mode = reader.getT("decimal128-mode", _settings.decimal128_mode);
 		_settings.time_mode = reader.getT("time-mode", _settings.time_mode);
+		_settings.reflection_cache = reader.getT("reflection-cache", false);
+
+		_alloc.mode = reader.getT("allocator", Allocator::Mode::Libc, {{"libc", Allocator::Mode::Libc}, {"pool", Allocator::Mode::Pool}});
+		_alloc.limit = reader.getT("memory-limit", tll::util::Size { 0 });
+		_gc.mode = reader.getT("gc", GcPolicy::Mode::Auto, {{"auto", GcPolicy::Mode::Auto}, {"idle", GcPolicy::Mode::Idle}, {"manual", GcPolicy::Mode::Manual}});
+		_gc.step = reader.getT("gc-step", 0);
+		_gc.pause = reader.getT("gc-pause", 200);
+		_hook_stat = reader.getT("hook-stat", false);
+		_shards = reader.getT("shards", 0u);
+		if (reader.getT("offload", false) && !_shards)
+			_shards = 1;
+		_shard_backpressure = reader.getT("shard-backpressure", true);
+		_shard_queue = reader.getT("shard-queue-size", 1024u);
+		_shard_key = reader.getT("shard-key", ShardKey::MsgId, {{"msgid", ShardKey::MsgId}, {"addr", ShardKey::Addr}, {"function", ShardKey::Function}});
+		_shard_ordered = reader.getT("shard-order", true, {{"global", true}, {"shard", false}});
+		if (reader.getT("profile", false)) {
+			_profiler.reset(new Profiler);
+			_profiler->interval = reader.getT("profile-interval", 10000u);
+			_profile_file = reader.getT("profile-file", fmt::format("{}.folded", this->_log.name()));
+		}
+
+		_batch_size = reader.getT("batch-size", 64u);
+		_batch_delay = reader.getT("batch-delay", tll::duration {});
+
+		_settings.index = &_index;
+		_settings.pushfield = select_pushfield(_settings);
 
 		_encoder.fixed_mode = _settings.fixed_mode;
 		_encoder.time_mode = _settings.time_mode;
+		_encoder.index = &_index;
 		_encoder.overflow_mode = reader.getT("overflow-mode", Encoder::Overflow::Error);
 
+		_converter.settings = &_settings;
+		_converter.index = &_index;
+		_converter.trim = _encoder.overflow_mode == Encoder::Overflow::Trim;
+		if (reader.getT("native-convert", false))
+			_encoder.converter = &_converter;
+
 		_message_mode = reader.getT("message-mode", MessageMode::Auto, {{"auto", MessageMode::Auto}, {"reflection", MessageMode::Reflection}, {"binary", MessageMode::Binary}, {"object", MessageMode::Object}});
 		if (!reader)
 			return this->_log.fail(EINVAL, "Invalid url: {}", reader.error());
 
+		if (_hook_stat)
+			CycleClock::ns_per_tick(); // Calibrate clock outside of hooks
+
 		if (scheme_control) {
 			this->_scheme_control.reset(this->context().scheme_load(*scheme_control));
 			if (!this->_scheme_control)
@@ -115,10 +226,58 @@ class LuaBase : public B
 
 	int _lua_open()
 	{
-		LuaRc lua(luaL_newstate());
+		LuaRc lua(_alloc.newstate());
 		if (!lua)
 			return this->_log.fail(EINVAL, "Failed to create lua state");
 
+		this->channelT()->_lua_hooks_reset(nullptr); // References from previous state are not valid
+
+		if (auto r = _lua_init(lua); r)
+			return r;
+
+		lua_pushlightuserdata(lua, this->channelT());
+		lua_pushcclosure(lua, _lua_msg_patch, 1);
+		lua_setglobal(lua, "tll_msg_patch");
+
+		lua_pushlightuserdata(lua, this->channelT());
+		lua_pushcclosure(lua, _lua_callback, 1);
+		lua_setglobal(lua, "tll_callback");
+
+		lua_pushlightuserdata(lua, this->channelT());
+		lua_pushcclosure(lua, _lua_callback_batch, 1);
+		lua_setglobal(lua, "tll_callback_batch");
+
+		lua_pushlightuserdata(lua, this->channelT());
+		lua_pushcclosure(lua, _lua_rebind_hooks, 1);
+		lua_setglobal(lua, "tll_rebind_hooks");
+
+		lua_pushlightuserdata(lua, this->channelT());
+		lua_pushcclosure(lua, _lua_profile_dump, 1);
+		lua_setglobal(lua, "tll_profile_dump");
+
+		_on_batch.bind(lua);
+		_batch_enabled = _batch_size > 0 && _on_batch && !_shards;
+
+		if (_shards && _shard_key == ShardKey::Function && !_on_shard_key.bind(lua))
+			return this->_log.fail(EINVAL, "Shard key function tll_shard_key is not defined");
+
+		if (_profiler) { // Script initialization is not sampled
+			_profiler->clear();
+			_profiler->attach(lua);
+		}
+
+		_gc.init(lua);
+		if (_gc.pending(lua))
+			this->_update_dcaps(tll::dcaps::Process, tll::dcaps::Process);
+
+		_lua = std::move(lua);
+
+		return 0;
+	}
+
+	/// Setup shared by channel and shard states: types, package path, user code and helper functions
+	int _lua_init(lua_State * lua, int shard = -1)
+	{
 		luaL_openlibs(lua);
 
 		LuaT<reflection::Array>::init(lua);
@@ -144,6 +303,9 @@ class LuaBase : public B
 		LuaT<tll::lua::Message>::init(lua);
 
 		LuaT<tll::lua::Config>::init(lua);
+		LuaT<tll::lua::Batch>::init(lua);
+		LuaT<tll::lua::MessageBuffer>::init(lua);
+		LuaT<tll::lua::Builder>::init(lua);
 
 		if (_extra_path.size()) {
 			lua_getglobal(lua, "package");
@@ -159,6 +321,15 @@ class LuaBase : public B
 			lua_pop(lua, 1);
 		}
 
+		if (_shards) { // Script is told that it is sharded before it is loaded
+			if (shard >= 0) {
+				lua_pushinteger(lua, shard);
+				lua_setglobal(lua, "tll_shard");
+			}
+			lua_pushinteger(lua, _shards);
+			lua_setglobal(lua, "tll_shard_count");
+		}
+
 		for (auto & code : _preload) {
 			if (_lua_load(lua, code))
 				return this->_log.fail(EINVAL, "Failed to load extra code");
@@ -176,18 +347,12 @@ class LuaBase : public B
 		lua_pushcfunction(lua, MetaT<reflection::Message>::pmap_check);
 		lua_setglobal(lua, "tll_msg_pmap_check");
 
-		lua_pushcfunction(lua.get(), tll::lua::TimePoint::create);
-		lua_setglobal(lua.get(), "tll_time_point");
-
-		lua_pushlightuserdata(lua, this->channelT());
-		lua_pushcclosure(lua, _lua_callback, 1);
-		lua_setglobal(lua, "tll_callback");
+		lua_pushcfunction(lua, tll::lua::TimePoint::create);
+		lua_setglobal(lua, "tll_time_point");
 
 		luaT_push<tll::lua::Logger>(lua, { tll_logger_copy(this->_log.ptr()) });
 		lua_setglobal(lua, "tll_logger");
 
-		_lua = std::move(lua);
-
 		return 0;
 	}
 
@@ -195,10 +360,10 @@ class LuaBase : public B
 	{
 		if (code.substr(0, 7) == "file://") {
 			auto filename = code.substr(7);
-			if (luaL_loadfile(lua, filename.c_str()))
+			if (_code_cache ? ChunkCache::instance().load(lua, code, _code_cache_dir) : luaL_loadfile(lua, filename.c_str()))
 				return this->_log.fail(EINVAL, "Failed to load file '{}': {}", filename, lua_tostring(lua, -1));
 		} else {
-			if (luaL_loadstring(lua, code.c_str()))
+			if (_code_cache ? ChunkCache::instance().load(lua, code, _code_cache_dir) : luaL_loadstring(lua, code.c_str()))
 				return this->_log.fail(EINVAL, "Failed to load source code {}:\n{}", lua_tostring(lua, -1), code);
 		}
 
@@ -217,10 +382,52 @@ class LuaBase : public B
 
 	void _lua_close()
 	{
-		if (_lua)
+		_shard_flush();
+		_shard_stop();
+		if (_lua) {
+			_batch_call();
 			_lua_on_close();
+		}
+		_batch.clear();
+		this->_update_dcaps(0, tll::dcaps::Process | tll::dcaps::Pending);
+		this->channelT()->_lua_hooks_reset(_lua);
+
+		if (_lua && _profiler)
+			_profile_dump(_profile_file);
 
 		_lua.reset();
+		_encoder.reset_plans();
+		_converter.reset();
+		_index.clear();
+		_reflection_pool.reset();
+	}
+
+	/// Resolve hook functions, derived channels extend it with their own hooks
+	int _lua_hooks_bind(lua_State * lua)
+	{
+		if (!_on_batch.bind(lua))
+			_batch_enabled = false;
+		if (_shards && _shard_key == ShardKey::Function)
+			_on_shard_key.bind(lua);
+		_handlers.rebind(lua);
+		return 0;
+	}
+
+	/// Resolve ``tll_on_data_<Name>`` handlers, message named ``batch`` is ambiguous if batch hook is defined
+	int _lua_handlers_build(const tll::Scheme * scheme)
+	{
+		_handlers.build(_lua, scheme, "tll_on_data_");
+		if (_on_batch && scheme && scheme->lookup("batch"))
+			return this->_log.fail(EINVAL, "Message 'batch' clashes with batch hook tll_on_data_batch, rename message or hook");
+		return 0;
+	}
+
+	/// Release hook references, lua is null if state is already destroyed
+	void _lua_hooks_reset(lua_State * lua)
+	{
+		_on_shard_key.reset(lua);
+		_on_batch.reset(lua);
+		_handlers.reset(lua);
 	}
 
 	int _lua_on_open(const tll::ConstConfig &props)
@@ -247,12 +454,23 @@ class LuaBase : public B
 	}
 
 	int _lua_pushmsg(const tll_msg_t * msg, const tll::Scheme * scheme, const tll::Channel * channel, bool skip_type = false)
+	{
+		return _lua_pushmsg(_lua, msg, scheme, channel, skip_type);
+	}
+
+	int _lua_pushmsg(lua_State * lua, const tll_msg_t * msg, const tll::Scheme * scheme, const tll::Channel * channel, bool skip_type = false)
+	{
+		return _lua_pushmsg(lua, msg, scheme, channel, skip_type, _settings, &_reflection_pool);
+	}
+
+	/// Push message with given settings, shard states use their own settings and no reflection pool
+	int _lua_pushmsg(lua_State * lua, const tll_msg_t * msg, const tll::Scheme * scheme, const tll::Channel * channel, bool skip_type, const Settings &settings, reflection::Pool * pool)
 	{
 		const auto skip_index = skip_type ? 0 : 1;
-		auto guard = StackGuard(_lua);
+		auto guard = StackGuard(lua);
 		if (!skip_type)
-			lua_pushinteger(_lua, msg->type);
-		lua_pushinteger(_lua, msg->seq);
+			lua_pushinteger(lua, msg->type);
+		lua_pushinteger(lua, msg->seq);
 
 		if (msg->type != TLL_MESSAGE_DATA)
 			scheme = channel->scheme(msg->type);
@@ -265,10 +483,10 @@ class LuaBase : public B
 		switch (mode) {
 		case MessageMode::Object:
 			if (message)
-				lua_pushstring(_lua, message->name);
+				lua_pushstring(lua, message->name);
 			else
-				lua_pushinteger(_lua, msg->msgid);
-			luaT_push(_lua, tll::lua::Message { msg, message, _settings });
+				lua_pushinteger(lua, msg->msgid);
+			luaT_push(lua, tll::lua::Message { msg, message, settings });
 			break;
 		case MessageMode::Reflection:
 		case MessageMode::Auto:
@@ -276,34 +494,532 @@ class LuaBase : public B
 				return this->_log.fail(-1, "Message {} not found", msg->msgid);
 			if (msg->size < message->size)
 				return this->_log.fail(-1, "Message {} size too small: {} < minimum {}", message->name, msg->size, message->size);
-			lua_pushstring(_lua, message->name);
-			luaT_push(_lua, reflection::Message { message, tll::make_view(*msg), _settings });
+			lua_pushstring(lua, message->name);
+			if (settings.reflection_cache && pool)
+				pool->push(lua, reflection::Message { message, tll::make_view(*msg), settings });
+			else
+				luaT_push(lua, reflection::Message { message, tll::make_view(*msg), settings });
 			break;
 		case MessageMode::Binary:
 			if (message)
-				lua_pushstring(_lua, message->name);
+				lua_pushstring(lua, message->name);
 			else
-				lua_pushnil(_lua);
-			lua_pushlstring(_lua, (const char *) msg->data, msg->size);
+				lua_pushnil(lua);
+			lua_pushlstring(lua, (const char *) msg->data, msg->size);
 			break;
 		}
 
-		lua_pushinteger(_lua, msg->msgid);
-		lua_pushinteger(_lua, msg->addr.i64);
-		lua_pushinteger(_lua, msg->time);
+		lua_pushinteger(lua, msg->msgid);
+		lua_pushinteger(lua, msg->addr.i64);
+		lua_pushinteger(lua, msg->time);
 		guard.release();
 		return 6 + skip_index;
 	}
 
+	/// Start hook or encode timer, zero if hook-stat is disabled
+	uint64_t _hook_start() const { return _hook_stat ? CycleClock::now() : 0; }
+
+	/// Export allocator counters and hook latency (if timer was started) into stat block, called after hooks
+	void _lua_stat(HookKind kind = HookKind::Data, uint64_t start = 0, bool error = false)
+	{
+		const auto end = start ? CycleClock::now() : 0;
+		if (_gc.mode == GcPolicy::Mode::Idle && _lua && _gc.pending(_lua)) // Hook allocated enough to start idle cycle
+			this->_update_dcaps(tll::dcaps::Process, tll::dcaps::Process);
+		auto stat = this->channelT()->stat();
+		if (!stat)
+			return;
+		auto page = stat->acquire();
+		if (!page)
+			return;
+		page->mem = _alloc.in_use;
+		page->mem_peak = _alloc.peak;
+		page->alloc = _alloc.allocations - _alloc_reported;
+		_alloc_reported = _alloc.allocations;
+		if (start) {
+			const auto dt = CycleClock::ns(end - start);
+			switch (kind) {
+			case HookKind::Data:
+				page->rx = dt;
+				if (error) page->rxerr = 1;
+				break;
+			case HookKind::Post:
+				page->tx = dt;
+				if (error) page->txerr = 1;
+				break;
+			case HookKind::Filter:
+				page->filter = dt;
+				if (error) page->ferr = 1;
+				break;
+			}
+		}
+		stat->release(page);
+	}
+
+	/// Account time spent in message encoding from tll_callback and similar functions
+	void _encode_stat(uint64_t start, bool error)
+	{
+		if (!start)
+			return;
+		const auto end = CycleClock::now();
+		auto stat = this->channelT()->stat();
+		if (!stat)
+			return;
+		auto page = stat->acquire();
+		if (!page)
+			return;
+		page->enc = CycleClock::ns(end - start);
+		if (error)
+			page->encerr = 1;
+		stat->release(page);
+	}
+
+	/// Add data message to the batch, flush it if it is full or message is from different source
+	int _batch_push(const tll_msg_t * msg, const tll::Scheme * scheme, const tll::Channel * channel)
+	{
+		if (!_batch.empty() && (_batch.scheme != scheme || _batch.channel != channel)) {
+			if (auto r = _batch_flush(); r)
+				return r;
+		}
+		if (_batch.empty()) {
+			_batch.scheme = scheme;
+			_batch.channel = channel;
+			if (_batch_delay.count())
+				_batch.first = tll::time::now();
+			this->_update_dcaps(tll::dcaps::Process | tll::dcaps::Pending, tll::dcaps::Process | tll::dcaps::Pending);
+		}
+		_batch.push(msg);
+		if (_batch.size() >= _batch_size)
+			return _batch_flush();
+		return 0;
+	}
+
+	/// Deliver pending batch, moves channel into Error state on failure if channel is fragile
+	int _batch_flush()
+	{
+		if (auto r = _batch_call(); r) {
+			if (_fragile)
+				this->state(tll::state::Error);
+			return r;
+		}
+		return 0;
+	}
+
+	int _batch_call()
+	{
+		this->_update_dcaps(_lua_gc_dcaps(), tll::dcaps::Process | tll::dcaps::Pending);
+		if (_batch.empty())
+			return 0;
+
+		// Messages can be added from inside the hook, detach current batch
+		BatchBuffer batch;
+		std::swap(batch, _batch);
+		batch.finalize();
+
+		auto ref = _lua.copy();
+		auto guard = StackGuard(ref);
+		auto scope = _reflection_pool.scope();
+
+		const auto start = _hook_start();
+		_on_batch.push(ref);
+		auto r = luaT_pcallpush(ref, 0, [&](lua_State * lua) {
+			luaT_push<Batch>(lua, { batch.messages.data(), batch.size(), batch.scheme, batch.channel, &_settings, _lua_batch_pushmsg, this->channelT() });
+			return 1;
+		});
+		if (r) {
+			auto text = fmt::format("Lua function tll_on_data_batch failed: {}\n  on first message of {}", lua_tostring(ref, -1), batch.size());
+			const auto level = _fragile ? tll::logger::Error : tll::logger::Warning;
+			tll_channel_log_msg(batch.channel, this->_log.name(), level, _dump_error, &batch.messages.front(), text.data(), text.size());
+		}
+		_lua_stat(HookKind::Data, start, r);
+
+		if (_batch.empty()) { // Reuse allocated buffers
+			batch.clear();
+			std::swap(batch, _batch);
+		}
+		return r ? EINVAL : 0;
+	}
+
+	int _process(long timeout, int flags)
+	{
+		if (_shard_busy())
+			return _shard_poll();
+		if (_batch.empty())
+			return _lua_gc_idle();
+		if (_batch_delay.count() && tll::time::now() - _batch.first < _batch_delay)
+			return _lua_gc_idle();
+		return _batch_flush();
+	}
+
+	/// Process dcap is kept only while idle collector has work, otherwise processor can sleep in poll
+	unsigned _lua_gc_dcaps()
+	{
+		return _lua && _gc.pending(_lua) ? tll::dcaps::Process : 0u;
+	}
+
+	/// Run collector step when there is nothing else to do, channel is not reported as active
+	int _lua_gc_idle()
+	{
+		if (!_lua)
+			return EAGAIN;
+		auto dt = _gc.idle(_lua);
+		if (!_gc.pending(_lua) && _batch.empty() && !_shard_busy())
+			this->_update_dcaps(0, tll::dcaps::Process);
+		if (!dt.count())
+			return EAGAIN;
+		if (auto stat = this->channelT()->stat(); stat) {
+			if (auto page = stat->acquire(); page) {
+				page->gc = std::chrono::duration_cast<std::chrono::nanoseconds>(dt).count();
+				page->mem = _alloc.in_use;
+				stat->release(page);
+			}
+		}
+		return EAGAIN;
+	}
+
+	/**
+	 * Start worker threads, derived channels call it when input scheme is known
+	 *
+	 * Hook name can be empty if script defines only per-message handlers, they are resolved
+	 * in worker states when ``handlers`` is set.
+	 */
+	int _shard_start(const std::string &hook, bool filter, bool handlers, const tll::Scheme * scheme, tll::Channel * channel)
+	{
+		_shard_flush();
+		_shard_stop();
+		_shard_source = channel;
+		for (unsigned i = 0; i < _shards; i++) {
+			auto w = std::make_unique<ShardWorker>(i, _shard_queue);
+			w->alloc.mode = _alloc.mode;
+			w->alloc.limit = _alloc.limit;
+			LuaRc lua(w->alloc.newstate());
+			if (!lua)
+				return this->_log.fail(EINVAL, "Failed to create lua state for shard {}", i);
+			if (auto r = _lua_init(lua, i); r)
+				return this->_log.fail(r, "Failed to init lua state for shard {}", i);
+
+			w->settings = _settings;
+			w->settings.index = &w->index;
+			w->settings.reflection_cache = false;
+			for (auto & s : _index.schemes())
+				w->index.add(s.get());
+			w->encoder.fixed_mode = _encoder.fixed_mode;
+			w->encoder.time_mode = _encoder.time_mode;
+			w->encoder.overflow_mode = _encoder.overflow_mode;
+			w->encoder.index = &w->index;
+
+			w->hook.name = hook;
+			w->filter = filter;
+			w->scheme = scheme;
+			w->channel = channel;
+			w->targets[ShardOutput::Callback] = { this->_scheme.get(), this->self() };
+			w->add_helpers(lua);
+			this->channelT()->_lua_shard_init(lua, *w);
+			if (_profiler) {
+				w->profiler.reset(new Profiler);
+				w->profiler->interval = _profiler->interval;
+				w->profiler->attach(lua);
+				w->profile_file = fmt::format("{}.shard{}", _profile_file, i);
+			}
+			if (handlers)
+				w->handlers.build(lua, scheme, "tll_on_data_");
+			if (!w->bind(lua))
+				return this->_log.fail(EINVAL, "Neither function '{}' nor per-message handlers found in shard {}", hook, i);
+			if (filter && !w->hook)
+				return this->_log.fail(EINVAL, "Filter function '{}' not found in shard {}", hook, i);
+
+			w->handler = _shard_handle;
+			w->user = this->channelT();
+			w->lua = std::move(lua);
+			_shard_workers.push_back(std::move(w));
+		}
+		for (auto & w : _shard_workers)
+			w->start();
+		_shard_sent = _shard_next = 0;
+		this->_log.info("Started {} shard workers", _shards);
+		return 0;
+	}
+
+	/// Stop workers and destroy their states, undelivered results are dropped
+	void _shard_stop()
+	{
+		for (auto & w : _shard_workers) {
+			w->stop();
+			if (w->profiler) {
+				if (auto r = w->profiler->dump(w->profile_file); r)
+					this->_log.error("Failed to write shard {} profile into '{}': {}", w->id, w->profile_file, strerror(r));
+			}
+		}
+		_shard_workers.clear();
+		_shard_deferred.clear();
+		_shard_sent = _shard_next = 0;
+		_shard_resume();
+		_shard_source = nullptr;
+	}
+
+	/// Resume source channel if it was suspended by backpressure
+	void _shard_resume()
+	{
+		if (!_shard_suspended)
+			return;
+		_shard_suspended = false;
+		if (_shard_source)
+			_shard_source->resume();
+	}
+
+	/// Register additional output functions in shard state, overridden by derived channels
+	void _lua_shard_init(lua_State * lua, ShardWorker &worker) {}
+
+	/// Deliver message produced in shard state
+	void _shard_output(int target, const tll_msg_t * msg)
+	{
+		if (target == ShardOutput::Callback)
+			this->_callback(msg);
+	}
+
+	/// Send data message to the worker selected by shard key
+	int _shard_push(const tll_msg_t * msg, const tll::Scheme * scheme, const tll::Channel * channel)
+	{
+		uint64_t key = 0;
+		switch (_shard_key) {
+		case ShardKey::MsgId: key = (uint32_t) msg->msgid; break;
+		case ShardKey::Addr: key = msg->addr.u64; break;
+		case ShardKey::Function: {
+			auto guard = StackGuard(_lua);
+			_on_shard_key.push(_lua);
+			auto r = luaT_pcallpush(_lua, 1, [&](lua_State * lua) { return _lua_pushmsg(lua, msg, scheme, channel, true); });
+			if (r < 0)
+				return EINVAL;
+			if (r)
+				return this->_log.fail(EINVAL, "Lua function tll_shard_key failed: {}", lua_tostring(_lua, -1));
+			if (lua_type(_lua, -1) == LUA_TSTRING) {
+				key = std::hash<std::string_view>{}(luaT_tostringview(_lua, -1));
+				break;
+			}
+			int isnum = 0;
+			key = lua_tointegerx(_lua, -1, &isnum);
+			if (!isnum)
+				return this->_log.fail(EINVAL, "Lua function tll_shard_key returned {}, expected integer or string", luaL_typename(_lua, -1));
+			break;
+		}
+		}
+
+		auto & w = *_shard_workers[key % _shard_workers.size()];
+		ShardJob job;
+		job.order = _shard_sent;
+		job.message = ShardOutput(ShardOutput::Pass, msg);
+		if (!w.overflow.empty() || !w.input.push(std::move(job))) // Queue is full, job is moved only on success
+			w.overflow.push_back(std::move(job));
+		_shard_sent++;
+		this->_update_dcaps(tll::dcaps::Process | tll::dcaps::Pending, tll::dcaps::Process | tll::dcaps::Pending);
+
+		const auto depth = _shard_sent - _shard_next;
+		if (_shard_backpressure && !_shard_suspended && _shard_source && depth >= _shard_queue * 3 / 4) {
+			this->_log.debug("Suspend {} with {} messages in flight", _shard_source->name(), depth);
+			_shard_suspended = true;
+			_shard_source->suspend();
+		}
+		if (auto stat = this->channelT()->stat(); stat) {
+			if (auto page = stat->acquire(); page) {
+				page->queue = depth;
+				stat->release(page);
+			}
+		}
+		return 0;
+	}
+
+	/// There are messages in workers or deferred non-data messages
+	bool _shard_busy() const { return _shard_next != _shard_sent || !_shard_deferred.empty(); }
+
+	/// Results are delivered only while channel is active or is flushing them on close
+	bool _shard_can_emit()
+	{
+		auto s = this->state();
+		return !_shard_workers.empty() && (s == tll::state::Active || s == tll::state::Closing);
+	}
+
+	/**
+	 * Keep non-data message until all data messages received before it are processed
+	 *
+	 * Returns false if there is nothing in flight and message can be handled immediately.
+	 * Deferred message is passed to ``_shard_output`` with ``ShardOutput::Other`` target.
+	 */
+	bool _shard_defer(const tll_msg_t * msg)
+	{
+		if (_shard_workers.empty() || !_shard_busy())
+			return false;
+		_shard_deferred.emplace_back(_shard_sent, ShardOutput(ShardOutput::Other, msg));
+		this->_update_dcaps(tll::dcaps::Process | tll::dcaps::Pending, tll::dcaps::Process | tll::dcaps::Pending);
+		return true;
+	}
+
+	/// Deliver finished results, in ordered mode only the one that is next in input order
+	int _shard_poll()
+	{
+		if (_shard_emitting)
+			return EAGAIN;
+		_shard_emitting = true;
+		size_t count = 0;
+		for (bool progress = true; progress && _shard_can_emit(); ) {
+			progress = _shard_emit_deferred();
+			for (size_t i = 0; i < _shard_workers.size() && _shard_can_emit(); i++) {
+				auto & w = *_shard_workers[i];
+				while (!w.overflow.empty() && w.input.push(std::move(w.overflow.front())))
+					w.overflow.pop_front();
+				auto r = w.output.front();
+				if (!r)
+					continue;
+				if (_shard_ordered && r->order != _shard_next)
+					continue;
+				if (!_shard_deferred.empty() && r->order >= _shard_deferred.front().first)
+					continue; // Received after deferred message that is not delivered yet
+				// Callbacks can close the channel and destroy worker, detach result and do not touch worker after emit
+				auto result = std::move(*r);
+				w.output.pop();
+				_shard_next++;
+				count++;
+				progress = true;
+				_shard_emit(result);
+			}
+		}
+		_shard_emitting = false;
+		if (_shard_workers.empty()) // Closed from callback
+			return 0;
+		if (_shard_suspended && _shard_sent - _shard_next <= _shard_queue / 4)
+			_shard_resume();
+		if (!_shard_busy())
+			this->_update_dcaps(_lua_gc_dcaps(), tll::dcaps::Process | tll::dcaps::Pending);
+		return count ? 0 : EAGAIN;
+	}
+
+	/// Deliver deferred messages that have all preceding results delivered, returns true if any
+	bool _shard_emit_deferred()
+	{
+		bool r = false;
+		while (!_shard_deferred.empty() && _shard_deferred.front().first <= _shard_next && _shard_can_emit()) {
+			auto o = std::move(_shard_deferred.front().second);
+			_shard_deferred.pop_front();
+			o.msg.data = o.data.data();
+			this->channelT()->_shard_output(o.target, &o.msg);
+			r = true;
+		}
+		return r;
+	}
+
+	/**
+	 * Wait until all messages sent to workers are delivered
+	 *
+	 * Blocks processor thread, so it is used only when channel is closed or workers are restarted.
+	 */
+	void _shard_flush()
+	{
+		while (_shard_busy() && !_shard_emitting && _shard_can_emit()) {
+			if (_shard_poll() == EAGAIN)
+				std::this_thread::yield();
+		}
+	}
+
+	void _shard_emit(ShardResult &r)
+	{
+		for (auto & o : r.outputs) {
+			if (!_shard_can_emit())
+				return;
+			o.msg.data = o.data.data();
+			this->channelT()->_shard_output(o.target, &o.msg);
+		}
+		if (r.error.size()) {
+			this->_log.error("Message {} failed in shard: {}", r.order, r.error);
+			if (_fragile)
+				this->state(tll::state::Error);
+		}
+	}
+
+	/// Run hook in worker thread
+	static void _shard_handle(void * user, ShardWorker &w, ShardJob &job, ShardResult &result)
+	{
+		auto self = static_cast<T *>(user);
+		auto lua = w.lua.get();
+		auto guard = StackGuard(lua);
+		auto & msg = job.message.msg;
+		msg.data = job.message.data.data();
+
+		auto hook = w.filter ? nullptr : w.handlers.lookup(msg.msgid);
+		if (!hook)
+			hook = w.hook ? &w.hook : nullptr;
+		if (!hook) { // Same as in channel state: message without hook is passed through
+			result.outputs.push_back(std::move(job.message));
+			return;
+		}
+
+		hook->push(lua);
+		auto r = luaT_pcallpush(lua, 1, [&](lua_State * lua) { return self->_lua_pushmsg(lua, &msg, w.scheme, w.channel, true, w.settings, nullptr); });
+		if (r < 0) {
+			result.error = "Failed to push message";
+			return;
+		}
+		if (r) {
+			result.error = fmt::format("Lua function {} failed: {}", hook->name, lua_tostring(lua, -1));
+			return;
+		}
+		if (w.filter && lua_toboolean(lua, -1))
+			result.outputs.push_back(std::move(job.message));
+	}
+
+	/// Batch elements can be alive at the same time, so they are not taken from shared reflection pool
+	static int _lua_batch_pushmsg(void * user, lua_State * lua, const Batch &batch, const tll_msg_t * msg)
+	{
+		auto self = static_cast<T *>(user);
+		return self->_lua_pushmsg(lua, msg, batch.scheme, batch.channel, true, self->_settings, nullptr);
+	}
+
 	static T * _lua_self(lua_State * lua, int index)
 	{
 		return (T *) lua_touserdata(lua, lua_upvalueindex(index));
 	}
 
+	static int _lua_rebind_hooks(lua_State * lua)
+	{
+		if (auto self = _lua_self(lua, 1); self) {
+			if (self->_lua_hooks_bind(lua))
+				return luaL_error(lua, "Failed to rebind hooks");
+			return 0;
+		}
+		return luaL_error(lua, "Non-userdata value in upvalue");
+	}
+
+	int _profile_dump(const std::string &filename)
+	{
+		if (auto r = _profiler->dump(filename); r)
+			return this->_log.fail(r, "Failed to write profile into '{}': {}", filename, strerror(r));
+		this->_log.info("Profile with {} samples written into '{}'", _profiler->samples, filename);
+		return 0;
+	}
+
+	static int _lua_profile_dump(lua_State * lua)
+	{
+		if (auto self = _lua_self(lua, 1); self) {
+			if (!self->_profiler)
+				return luaL_error(lua, "Profiler is disabled");
+			auto filename = luaL_optstring(lua, 1, self->_profile_file.c_str());
+			if (self->_profile_dump(filename))
+				return luaL_error(lua, "Failed to write profile into '%s'", filename);
+			return 0;
+		}
+		return luaL_error(lua, "Non-userdata value in upvalue");
+	}
+
+	static int _lua_msg_patch(lua_State * lua)
+	{
+		if (auto self = _lua_self(lua, 1); self)
+			return msg_patch(lua, self->_encoder);
+		return luaL_error(lua, "Non-userdata value in upvalue");
+	}
+
 	static int _lua_callback(lua_State * lua)
 	{
 		if (auto self = _lua_self(lua, 1); self) {
+			const auto start = self->_hook_start();
 			auto msg = self->_encoder.encode_stack(lua, self->_scheme.get(), self->self(), 0);
+			self->_encode_stat(start, !msg);
 			if (!msg) {
 				self->_log.error("Failed to convert message: {}", self->_encoder.error);
 				return luaL_error(lua, "Failed to convert message");
@@ -313,6 +1029,29 @@ class LuaBase : public B
 		}
 		return luaL_error(lua, "Non-userdata value in upvalue");
 	}
+
+	/// Batched tll_callback: list of messages in table or message object form
+	static int _lua_callback_batch(lua_State * lua)
+	{
+		if (auto self = _lua_self(lua, 1); self) {
+			luaL_checktype(lua, 1, LUA_TTABLE);
+			auto size = luaL_len(lua, 1);
+			for (auto i = 1; i <= size; i++) {
+				lua_settop(lua, 1);
+				lua_rawgeti(lua, 1, i);
+				const auto start = self->_hook_start();
+				auto msg = self->_encoder.encode_stack(lua, self->_scheme.get(), self->self(), 1);
+				self->_encode_stat(start, !msg);
+				if (!msg) {
+					self->_log.error("Failed to convert message {}: {}", i, self->_encoder.error);
+					return luaL_error(lua, "Failed to convert message %d", i);
+				}
+				self->_callback(msg);
+			}
+			return 0;
+		}
+		return luaL_error(lua, "Non-userdata value in upvalue");
+	}
 };
 
 } // namespace tll::lua
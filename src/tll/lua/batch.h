@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_BATCH_H
+#define _TLL_LUA_BATCH_H
+
+#include "tll/lua/luat.h"
+#include "tll/lua/reflection.h"
+
+#include <tll/channel.h>
+#include <tll/util/time.h>
+
+#include <vector>
+
+namespace tll::lua {
+
+/// Storage for messages accumulated for batch delivery, message bodies are copied
+struct BatchBuffer
+{
+	std::vector<tll_msg_t> messages;
+	std::vector<char> data;
+
+	const tll::Scheme * scheme = nullptr;
+	const tll::Channel * channel = nullptr;
+	tll::time_point first = {}; ///< Time of first message in the batch
+
+	size_t size() const { return messages.size(); }
+	bool empty() const { return messages.empty(); }
+
+	void push(const tll_msg_t * msg)
+	{
+		auto & m = messages.emplace_back(*msg);
+		m.data = (const void *) data.size(); // Offset until finalize, buffer can be reallocated
+		data.insert(data.end(), (const char *) msg->data, (const char *) msg->data + msg->size);
+	}
+
+	/// Convert stored offsets into pointers, no more messages can be added after this call
+	void finalize()
+	{
+		for (auto & m : messages)
+			m.data = data.data() + (size_t) m.data;
+	}
+
+	void clear()
+	{
+		messages.clear();
+		data.clear();
+		scheme = nullptr;
+		channel = nullptr;
+	}
+};
+
+/**
+ * Lua view of the message batch
+ *
+ * ``for i, seq, name, data, msgid, addr, time in pairs(batch)`` iterates over messages with same
+ * arguments as ``tll_on_data`` hook, ``batch[i]`` returns message object that can be forwarded and
+ * ``#batch`` is number of messages.
+ */
+struct Batch
+{
+	const tll_msg_t * messages = nullptr;
+	size_t size = 0;
+	const tll::Scheme * scheme = nullptr;
+	const tll::Channel * channel = nullptr;
+	const Settings * settings = nullptr;
+
+	/// Push message in the same way as it is done for per-message hooks
+	int (*pushmsg)(void * user, lua_State * lua, const Batch &batch, const tll_msg_t * msg) = nullptr;
+	void * user = nullptr;
+};
+
+template <>
+struct MetaT<Batch> : public MetaBase
+{
+	static constexpr std::string_view name = "tll_batch";
+
+	static int index(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Batch>(lua, 1);
+		auto key = luaL_checkinteger(lua, 2);
+		if (key < 1 || (size_t) key > self.size)
+			return luaL_error(lua, "Batch index out of bounds (size %d): %d", (int) self.size, (int) key);
+		auto msg = self.messages + key - 1;
+		auto message = self.scheme ? self.scheme->lookup(msg->msgid) : nullptr;
+		luaT_push<Message>(lua, { msg, message, *self.settings });
+		return 1;
+	}
+
+	static int len(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Batch>(lua, 1);
+		lua_pushinteger(lua, self.size);
+		return 1;
+	}
+
+	static int pairs(lua_State* lua)
+	{
+		lua_pushcfunction(lua, next);
+		lua_pushvalue(lua, 1);
+		lua_pushinteger(lua, 0);
+		return 3;
+	}
+
+	static int next(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Batch>(lua, 1);
+		auto key = luaL_optinteger(lua, 2, 0);
+		if (key < 0 || (size_t) key >= self.size)
+			return 0;
+		lua_pushinteger(lua, key + 1);
+		auto r = self.pushmsg(self.user, lua, self, self.messages + key);
+		if (r < 0)
+			return luaL_error(lua, "Failed to push message %d", (int) key + 1);
+		return r + 1;
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_BATCH_H
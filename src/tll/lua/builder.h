@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_BUILDER_H
+#define _TLL_LUA_BUILDER_H
+
+#include "tll/lua/encoder.h"
+#include "tll/lua/luat.h"
+
+#include <tll/channel.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace tll::lua {
+
+/**
+ * Reusable binary message bound to the channel
+ *
+ * Field assignment ``b.f0 = x`` encodes value directly into message buffer at field offset
+ * (setting pmap bit), ``b:post(seq, addr)`` posts current body into the channel and
+ * ``b:reset()`` clears all fields. Offset pointer fields are appended to the buffer, so assignment
+ * that grew the buffer can not be repeated until reset.
+ */
+struct Builder
+{
+	tll::Channel * channel = nullptr;
+	Encoder * encoder = nullptr;
+	tll::scheme::ConstSchemePtr scheme;
+	const tll::scheme::Message * message = nullptr;
+	int type = TLL_MESSAGE_DATA;
+	std::vector<char> buf;
+	std::vector<std::string> appended; ///< Keys that appended data to the buffer since last reset
+
+	void reset()
+	{
+		buf.resize(0);
+		buf.resize(message->size);
+		appended.clear();
+	}
+};
+
+template <>
+struct MetaT<Builder> : public MetaBase
+{
+	static constexpr std::string_view name = "tll_builder";
+
+	static int index(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Builder>(lua, 1);
+		auto key = luaT_checkstringview(lua, 2);
+
+		if (key == "post") {
+			lua_pushcfunction(lua, post);
+		} else if (key == "reset") {
+			lua_pushcfunction(lua, reset);
+		} else if (key == "name") {
+			lua_pushstring(lua, self.message->name);
+		} else if (key == "msgid") {
+			lua_pushinteger(lua, self.message->msgid);
+		} else
+			return luaL_error(lua, "Invalid Builder attribute '%s', fields are write-only", key.data());
+		return 1;
+	}
+
+	static int newindex(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Builder>(lua, 1);
+		lua_settop(lua, 3);
+
+		auto key = luaT_checkstringview(lua, 2);
+		if (!self.appended.empty() && std::find(self.appended.begin(), self.appended.end(), key) != self.appended.end())
+			return luaL_error(lua, "Field %s is already set, call reset() before assigning it again", key.data());
+		const auto size = self.buf.size();
+		_set(lua, self, key);
+		if (self.buf.size() != size)
+			self.appended.emplace_back(key);
+		return 0;
+	}
+
+	static void _set(lua_State* lua, Builder &self, std::string_view key)
+	{
+		auto view = tll::make_view(self.buf);
+		auto encoder = self.encoder;
+		auto message = self.message;
+		if (auto fields = encoder->index ? encoder->index->fields(message) : nullptr; fields) {
+			if (auto field = fields->lookup(lua, 2); field) { // Cached by interned key, dotted paths fall through
+				if (message->pmap)
+					tll_scheme_pmap_set(view.view(message->pmap->offset).data(), field->index);
+				if ((encoder->*Encoder::plan_handler(field))(field, view.view(field->offset), lua))
+					luaL_error(lua, "Failed to set field %s: %s", field->name, encoder->error.c_str());
+				return;
+			}
+		}
+
+		if (encoder->patch(message, view, lua, key))
+			luaL_error(lua, "Failed to set field %s: %s", key.data(), encoder->error.c_str());
+	}
+
+	static int post(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Builder>(lua, 1);
+		tll_msg_t msg = {};
+		msg.type = self.type;
+		msg.msgid = self.message->msgid;
+		msg.seq = luaL_optinteger(lua, 2, 0);
+		msg.addr.i64 = luaL_optinteger(lua, 3, 0);
+		msg.data = self.buf.data();
+		msg.size = self.buf.size();
+		if (auto r = self.channel->post(&msg); r)
+			return luaL_error(lua, "Failed to post: %d", r);
+		return 0;
+	}
+
+	static int reset(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Builder>(lua, 1);
+		self.reset();
+		return 0;
+	}
+
+	static int gc(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Builder>(lua, 1);
+		self.~Builder();
+		return 0;
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_BUILDER_H
@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_CACHE_H
+#define _TLL_LUA_CACHE_H
+
+#include "tll/lua/luat.h"
+
+#include <fmt/format.h>
+
+#include <fstream>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tll::lua {
+
+/**
+ * Process wide cache of compiled Lua chunks
+ *
+ * Code is given in the same form as ``code`` parameter: inline string or ``file://`` filename.
+ * Inline code is keyed by its text, files by path, modification time and size. Compiled chunk is
+ * stored as ``lua_dump`` output and later loaded with ``lua_load`` without parsing. Optional cache
+ * directory keeps chunks between processes, files that do not match key or Lua version are ignored.
+ * Bytecode from the directory is loaded without verification, so it must be writable only by
+ * trusted users. Memory cache is limited by total size of keys and chunks, oldest entries are
+ * evicted first.
+ */
+class ChunkCache
+{
+	using Chunk = std::shared_ptr<const std::string>;
+
+	std::mutex _lock;
+	std::unordered_map<std::string, Chunk> _chunks;
+	std::deque<std::string> _order; ///< Keys in insertion order, used for eviction
+	size_t _size = 0; ///< Total size of keys and chunks
+	size_t _limit = 16 * 1024 * 1024;
+
+ public:
+	static ChunkCache & instance()
+	{
+		static ChunkCache cache;
+		return cache;
+	}
+
+	/// Load chunk onto the stack, returns Lua status code and leaves error message on failure
+	int load(lua_State * lua, std::string_view code, std::string_view dir = {})
+	{
+		constexpr std::string_view prefix = "file://";
+		const bool file = code.substr(0, prefix.size()) == prefix;
+		const auto filename = std::string(file ? code.substr(prefix.size()) : std::string_view());
+
+		std::string key;
+		if (file) {
+			struct stat st = {};
+			if (::stat(filename.c_str(), &st)) // Let Lua report error
+				return luaL_loadfile(lua, filename.c_str());
+			key = fmt::format("file:{}:{}.{}:{}", filename, (long long) st.st_mtim.tv_sec, (long long) st.st_mtim.tv_nsec, (long long) st.st_size);
+		} else
+			key = fmt::format("code:{}", code);
+
+		if (auto chunk = _lookup(key); chunk) {
+			if (_load(lua, *chunk) == LUA_OK)
+				return LUA_OK;
+			lua_pop(lua, 1);
+		}
+
+		const auto path = dir.empty() ? std::string() : fmt::format("{}/{:016x}.luac", dir, std::hash<std::string>{}(key));
+		if (path.size()) {
+			if (auto chunk = _read(path, key); chunk) {
+				if (_load(lua, *chunk) == LUA_OK) {
+					_insert(key, std::move(chunk));
+					return LUA_OK;
+				}
+				lua_pop(lua, 1);
+			}
+		}
+
+		auto r = file ? luaL_loadfile(lua, filename.c_str()) : luaL_loadbuffer(lua, code.data(), code.size(), std::string(code).c_str());
+		if (r != LUA_OK)
+			return r;
+
+		auto data = std::make_shared<std::string>();
+		if (lua_dump(lua, _writer, data.get(), 0))
+			return LUA_OK; // Chunk is loaded, only caching failed
+		if (path.size())
+			_write(path, key, *data);
+		_insert(key, std::move(data));
+		return LUA_OK;
+	}
+
+	void clear()
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		_chunks.clear();
+		_order.clear();
+		_size = 0;
+	}
+
+	/// Set memory limit in bytes, entries above it are evicted
+	void limit(size_t value)
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		_limit = value;
+		_evict();
+	}
+
+ private:
+	Chunk _lookup(const std::string &key)
+	{
+		std::unique_lock<std::mutex> lock(_lock);
+		auto it = _chunks.find(key);
+		return it == _chunks.end() ? nullptr : it->second;
+	}
+
+	void _insert(const std::string &key, Chunk chunk)
+	{
+		const auto size = key.size() + chunk->size();
+		std::unique_lock<std::mutex> lock(_lock);
+		if (size > _limit)
+			return;
+		if (!_chunks.emplace(key, std::move(chunk)).second)
+			return;
+		_order.push_back(key);
+		_size += size;
+		_evict();
+	}
+
+	void _evict()
+	{
+		while (_size > _limit && _order.size()) {
+			auto it = _chunks.find(_order.front());
+			_size -= it->first.size() + it->second->size();
+			_chunks.erase(it);
+			_order.pop_front();
+		}
+	}
+
+	static int _load(lua_State * lua, const std::string &chunk)
+	{
+		return luaL_loadbufferx(lua, chunk.data(), chunk.size(), "=cache", "b");
+	}
+
+	static int _writer(lua_State *, const void * data, size_t size, void * user)
+	{
+		static_cast<std::string *>(user)->append(static_cast<const char *>(data), size);
+		return 0;
+	}
+
+	/// Cache file: key followed by zero byte and chunk body
+	static Chunk _read(const std::string &path, const std::string &key)
+	{
+		std::ifstream f(path, std::ios::binary);
+		if (!f)
+			return nullptr;
+		std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+		if (data.size() <= key.size() || data.compare(0, key.size(), key) || data[key.size()] != '\0')
+			return nullptr;
+		return std::make_shared<std::string>(data.substr(key.size() + 1));
+	}
+
+	static void _write(const std::string &path, const std::string &key, const std::string &chunk)
+	{
+		// Write into temporary file and rename it so concurrent readers never see partial data
+		auto tmp = fmt::format("{}.{}.tmp", path, getpid());
+		{
+			std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+			if (!f)
+				return;
+			f.write(key.data(), key.size());
+			f.put('\0');
+			f.write(chunk.data(), chunk.size());
+			if (!f) {
+				f.close();
+				unlink(tmp.c_str());
+				return;
+			}
+		}
+		if (rename(tmp.c_str(), path.c_str()))
+			unlink(tmp.c_str());
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_CACHE_H
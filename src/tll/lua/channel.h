@@ -4,6 +4,7 @@
 #ifndef _TLL_LUA_CHANNEL_H
 #define _TLL_LUA_CHANNEL_H
 
+#include <tll/lua/builder.h>
 #include <tll/lua/config.h>
 #include <tll/lua/encoder.h>
 #include <tll/lua/luat.h>
@@ -40,6 +41,8 @@ struct MetaT<Channel> : public MetaBase
 			lua_pushcfunction(lua, post);
 		} else if (key == "scheme") {
 			lua_pushcfunction(lua, scheme);
+		} else if (key == "builder") {
+			lua_pushcfunction(lua, builder);
 		} else if (key == "context") {
 			luaT_push<Context>(lua, { self.ptr->context(), self.encoder });
 		} else if (key == "config") {
@@ -72,6 +75,33 @@ struct MetaT<Channel> : public MetaBase
 		return 1;
 	}
 
+	/// Create message builder: ``channel:builder(name, mode)``, mode is 'data' (default) or 'control'
+	static int builder(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<Channel>(lua, 1);
+		auto name = luaT_checkstringview(lua, 2);
+		std::string_view mstr = "data";
+		if (lua_gettop(lua) >= 3)
+			mstr = luaT_checkstringview(lua, 3);
+		auto mode = TLL_MESSAGE_DATA;
+		if (mstr == "data") {
+		} else if (mstr == "control")
+			mode = TLL_MESSAGE_CONTROL;
+		else
+			return luaL_error(lua, "Invalid scheme mode: '%s', need one of 'data' or 'control'", mstr.data());
+		auto s = self.ptr->scheme(mode);
+		if (!s)
+			return luaL_error(lua, "Channel has no %s scheme", mstr.data());
+		auto message = s->lookup(name);
+		if (!message)
+			return luaL_error(lua, "Message '%s' not found", name.data());
+
+		Builder b = { self.ptr, self.encoder, tll::scheme::ConstSchemePtr(s->ref()), message, mode };
+		b.reset();
+		luaT_push(lua, std::move(b));
+		return 1;
+	}
+
 	static int post(lua_State* lua)
 	{
 		auto & self = luaT_checkuserdata<Channel>(lua, 1);
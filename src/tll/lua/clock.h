@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_CLOCK_H
+#define _TLL_LUA_CLOCK_H
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace tll::lua {
+
+/**
+ * Cheap interval clock for hook latency accounting
+ *
+ * On x86 time stamp counter is used, tick length is calibrated once against steady clock.
+ * On other platforms ticks are steady clock nanoseconds.
+ */
+struct CycleClock
+{
+	static uint64_t now()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	/// Convert interval in ticks to nanoseconds
+	static long long ns(uint64_t ticks) { return (long long) (ticks * ns_per_tick()); }
+
+	static double ns_per_tick()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		static const double value = _calibrate();
+		return value;
+#else
+		return 1.;
+#endif
+	}
+
+ private:
+	static double _calibrate()
+	{
+		using clock = std::chrono::steady_clock;
+		auto start = clock::now();
+		auto tsc = now();
+		auto end = start;
+		do {
+			end = clock::now();
+		} while (end - start < std::chrono::milliseconds(1));
+		auto ticks = now() - tsc;
+		if (!ticks)
+			return 1.;
+		return std::chrono::duration<double, std::nano>(end - start).count() / ticks;
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_CLOCK_H
@@ -0,0 +1,472 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_CONVERT_H
+#define _TLL_LUA_CONVERT_H
+
+#include "tll/lua/index.h"
+#include "tll/lua/reflection.h"
+
+#include <tll/scheme.h>
+#include <tll/scheme/error-stack.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace tll::lua {
+
+/**
+ * Binary converter between messages of different schemes
+ *
+ * For each pair of source and destination messages conversion plan is built once: fields are
+ * matched by name and operation is selected from field types and reflection settings, so result
+ * is the same as passing reflection through Lua encoder. If some field can not be converted
+ * natively whole plan is marked as unsupported and caller falls back to encoding via Lua.
+ */
+class Converter : public tll::scheme::ErrorStack
+{
+ public:
+	using Field = tll::scheme::Field;
+	using Message = tll::scheme::Message;
+	using View = tll::memoryview<std::vector<char>>;
+	using Source = tll::memoryview<const tll_msg_t>;
+
+	struct Plan;
+
+	struct Op
+	{
+		enum Kind { Numeric, Enum, Decimal128, String, Message, List } kind = Numeric;
+		const Field * src = nullptr;
+		const Field * dst = nullptr;
+		long long mul = 1; ///< Fixed precision or time resolution rescale
+		long long div = 1;
+		int (*numeric)(Converter &, const Op &, const void *, void *) = nullptr;
+		std::vector<std::pair<long long, long long>> enums; ///< Source to destination enum values, sorted
+		const Plan * plan = nullptr; ///< Plan for submessage
+		std::unique_ptr<Op> element; ///< Element conversion for arrays and lists
+	};
+
+	struct Plan
+	{
+		const Message * src = nullptr;
+		const Message * dst = nullptr;
+		bool valid = true;
+		std::vector<Op> ops;
+	};
+
+	const Settings * settings = nullptr;
+	const SchemeIndex * index = nullptr; ///< Only messages from indexed schemes are converted
+	bool trim = false; ///< Trim values out of range instead of failing
+
+	/// Convert message body into buffer, EAGAIN if conversion is not supported for these messages
+	int convert(const Message * src, Source data, const Message * dst, std::vector<char> &buf)
+	{
+		auto plan = lookup(src, dst);
+		if (!plan || !plan->valid)
+			return EAGAIN;
+		if (data.size() < src->size)
+			return fail(EMSGSIZE, "Message size too small: {} < minimum {}", data.size(), src->size);
+		buf.resize(0);
+		buf.resize(dst->size);
+		return convert(*plan, data, tll::make_view(buf));
+	}
+
+	/// Drop plans, must be called when scheme index is cleared
+	void reset() { _plans.clear(); }
+
+ private:
+	std::map<std::pair<const Message *, const Message *>, std::unique_ptr<Plan>> _plans;
+
+	const Plan * lookup(const Message * src, const Message * dst)
+	{
+		auto key = std::make_pair(src, dst);
+		if (auto it = _plans.find(key); it != _plans.end())
+			return it->second.get();
+		if (!index || !index->fields(src) || !index->fields(dst))
+			return nullptr;
+
+		// Insert before building so recursive lookups find it
+		auto & plan = _plans[key];
+		plan.reset(new Plan { src, dst });
+		build(*plan);
+		return plan.get();
+	}
+
+	void build(Plan &plan)
+	{
+		for (auto d = plan.dst->fields; d; d = d->next) {
+			if (d == plan.dst->pmap)
+				continue;
+			auto s = tll::scheme::lookup_name(plan.src->fields, d->name);
+			if (!s)
+				continue; // Left zero as in Lua conversion
+			Op op;
+			op.src = s;
+			op.dst = d;
+			if (!build(op)) {
+				plan.valid = false;
+				return;
+			}
+			plan.ops.push_back(std::move(op));
+		}
+	}
+
+	static bool string_like(const Field * f)
+	{
+		return f->type == Field::Bytes || (f->type == Field::Pointer && f->sub_type == Field::ByteString);
+	}
+
+	static bool list_like(const Field * f)
+	{
+		return f->type == Field::Array || (f->type == Field::Pointer && f->sub_type != Field::ByteString);
+	}
+
+	static bool numeric_like(const Field * f)
+	{
+		switch (f->type) {
+		case Field::Int8: case Field::Int16: case Field::Int32: case Field::Int64:
+		case Field::UInt8: case Field::UInt16: case Field::UInt32: case Field::UInt64:
+		case Field::Double:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	static bool same_bits(const tll::scheme::BitFields * l, const tll::scheme::BitFields * r)
+	{
+		auto i = l->values, j = r->values;
+		for (; i && j; i = i->next, j = j->next) {
+			if (std::string_view(i->name) != j->name || i->offset != j->offset || i->size != j->size)
+				return false;
+		}
+		return !i && !j;
+	}
+
+	/// Convert resolution into (numerator, denominator) of seconds
+	static std::pair<long long, long long> resolution(tll_scheme_time_resolution_t r)
+	{
+		switch (r) {
+		case TLL_SCHEME_TIME_NS: return { 1, 1000000000 };
+		case TLL_SCHEME_TIME_US: return { 1, 1000000 };
+		case TLL_SCHEME_TIME_MS: return { 1, 1000 };
+		case TLL_SCHEME_TIME_SECOND: return { 1, 1 };
+		case TLL_SCHEME_TIME_MINUTE: return { 60, 1 };
+		case TLL_SCHEME_TIME_HOUR: return { 3600, 1 };
+		case TLL_SCHEME_TIME_DAY: return { 86400, 1 };
+		}
+		return { 0, 0 };
+	}
+
+	bool build(Op &op)
+	{
+		auto s = op.src;
+		auto d = op.dst;
+		if (string_like(s) && string_like(d)) {
+			op.kind = Op::String;
+			return true;
+		} else if (list_like(s) && list_like(d)) {
+			op.kind = Op::List;
+			op.element.reset(new Op);
+			op.element->src = s->type == Field::Array ? s->type_array : s->type_ptr;
+			op.element->dst = d->type == Field::Array ? d->type_array : d->type_ptr;
+			return build(*op.element);
+		} else if (s->type == Field::Message && d->type == Field::Message) {
+			op.kind = Op::Message;
+			op.plan = lookup(s->type_msg, d->type_msg);
+			return op.plan && op.plan->valid;
+		} else if (s->type == Field::Decimal128 && d->type == Field::Decimal128) {
+			op.kind = Op::Decimal128;
+			return settings->decimal128_mode == Settings::Decimal128::Object;
+		} else if (!numeric_like(s) || !numeric_like(d) || s->sub_type != d->sub_type)
+			return false;
+
+		op.kind = Op::Numeric;
+		op.numeric = numeric_from(s, d);
+
+		switch (s->sub_type) {
+		case Field::SubNone:
+			return true;
+		case Field::Enum:
+			if (s->type == Field::Double || d->type == Field::Double)
+				return false;
+			if (settings->enum_mode != Settings::Enum::String)
+				return true;
+			op.kind = Op::Enum;
+			for (auto v = s->type_enum->values; v; v = v->next) {
+				if (auto r = tll::scheme::lookup_name(d->type_enum->values, v->name); r)
+					op.enums.emplace_back(v->value, r->value);
+			}
+			std::sort(op.enums.begin(), op.enums.end());
+			return true;
+		case Field::Bits:
+			if (settings->bits_mode == Settings::Bits::Int)
+				return true;
+			return same_bits(s->type_bits, d->type_bits);
+		case Field::Fixed:
+			if (s->type == Field::Double || d->type == Field::Double)
+				return false;
+			if (settings->fixed_mode == Settings::Fixed::Int)
+				return true;
+			if (settings->fixed_mode != Settings::Fixed::Object)
+				return false;
+			if (int dprec = d->fixed_precision - s->fixed_precision; dprec > 0)
+				op.mul = intpow(10, dprec);
+			else
+				op.div = intpow(10, -dprec);
+			return true;
+		case Field::TimePoint: {
+			if (settings->time_mode == Settings::Time::Int)
+				return true;
+			if (settings->time_mode != Settings::Time::Object)
+				return false;
+			if (s->time_resolution == d->time_resolution)
+				return true;
+			auto [snum, sden] = resolution(s->time_resolution);
+			auto [dnum, dden] = resolution(d->time_resolution);
+			if (!snum || !dnum)
+				return false;
+			auto mul = snum * dden;
+			auto div = sden * dnum;
+			if (mul >= div)
+				op.mul = mul / div;
+			else
+				op.div = div / mul;
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+
+	using NumericFunc = int (*)(Converter &, const Op &, const void *, void *);
+
+	static NumericFunc numeric_from(const Field * src, const Field * dst)
+	{
+		switch (src->type) {
+		case Field::Int8: return numeric_to<int8_t>(dst);
+		case Field::Int16: return numeric_to<int16_t>(dst);
+		case Field::Int32: return numeric_to<int32_t>(dst);
+		case Field::Int64: return numeric_to<int64_t>(dst);
+		case Field::UInt8: return numeric_to<uint8_t>(dst);
+		case Field::UInt16: return numeric_to<uint16_t>(dst);
+		case Field::UInt32: return numeric_to<uint32_t>(dst);
+		case Field::UInt64: return numeric_to<uint64_t>(dst);
+		case Field::Double: return numeric_to<double>(dst);
+		default: return nullptr;
+		}
+	}
+
+	template <typename F>
+	static NumericFunc numeric_to(const Field * dst)
+	{
+		switch (dst->type) {
+		case Field::Int8: return convert_numeric<F, int8_t>;
+		case Field::Int16: return convert_numeric<F, int16_t>;
+		case Field::Int32: return convert_numeric<F, int32_t>;
+		case Field::Int64: return convert_numeric<F, int64_t>;
+		case Field::UInt8: return convert_numeric<F, uint8_t>;
+		case Field::UInt16: return convert_numeric<F, uint16_t>;
+		case Field::UInt32: return convert_numeric<F, uint32_t>;
+		case Field::UInt64: return convert_numeric<F, uint64_t>;
+		case Field::Double: return convert_numeric<F, double>;
+		default: return nullptr;
+		}
+	}
+
+	template <typename F, typename T>
+	static int convert_numeric(Converter &self, const Op &op, const void * src, void * dst)
+	{
+		auto v = *static_cast<const F *>(src);
+		if constexpr (std::is_integral_v<F>) {
+			if (op.kind == Op::Enum) {
+				auto it = std::lower_bound(op.enums.begin(), op.enums.end(), std::make_pair((long long) v, std::numeric_limits<long long>::min()));
+				if (it == op.enums.end() || it->first != (long long) v)
+					return self.fail(EINVAL, "Enum {} value {} has no match in {}", op.src->type_enum->name, v, op.dst->type_enum->name);
+				return self.store<T>(dst, it->second);
+			}
+		}
+		if (op.mul == 1 && op.div == 1)
+			return self.store<T>(dst, v);
+		if constexpr (std::is_floating_point_v<F> || std::is_floating_point_v<T>)
+			return self.store<T>(dst, ((double) v) * op.mul / op.div);
+		else if constexpr (std::is_signed_v<F>) {
+			long long r;
+			if (__builtin_mul_overflow((long long) v, op.mul, &r))
+				return self.store_overflow<T>(dst, v, op.mul, v < 0);
+			return self.store<T>(dst, r / op.div); // Precision decrease truncates towards zero
+		} else {
+			unsigned long long r;
+			if (__builtin_mul_overflow((unsigned long long) v, (unsigned long long) op.mul, &r))
+				return self.store_overflow<T>(dst, v, op.mul, false);
+			return self.store<T>(dst, r / op.div);
+		}
+	}
+
+	/// Rescaled value does not fit into 64 bits, fail or trim like in store
+	template <typename T, typename V>
+	int store_overflow(void * ptr, V v, long long mul, bool negative)
+	{
+		if (!trim)
+			return fail(EINVAL, "Value {} * {} out of range [{}, {}]", v, mul, std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+		*static_cast<T *>(ptr) = negative ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+		return 0;
+	}
+
+	template <typename T, typename V>
+	int store(void * ptr, V v)
+	{
+		if constexpr (std::is_floating_point_v<T>) {
+			*static_cast<T *>(ptr) = v;
+			return 0;
+		} else if constexpr (std::is_floating_point_v<V>) {
+			if (v != (V) (long long) v)
+				return fail(EINVAL, "Failed to convert value '{}' to integer", v);
+			return store<T>(ptr, (long long) v);
+		} else {
+			auto r = (T) v;
+			bool overflow = false;
+			if constexpr (std::is_signed_v<V>) {
+				if (v < 0)
+					overflow = std::is_unsigned_v<T> || (long long) v < (long long) std::numeric_limits<T>::min();
+				else
+					overflow = (unsigned long long) v > (unsigned long long) std::numeric_limits<T>::max();
+			} else
+				overflow = (unsigned long long) v > (unsigned long long) std::numeric_limits<T>::max();
+			if (overflow) {
+				if (!trim)
+					return fail(EINVAL, "Value {} out of range [{}, {}]", v, std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+				if constexpr (std::is_signed_v<V>)
+					r = v < 0 ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+				else
+					r = std::numeric_limits<T>::max();
+			}
+			*static_cast<T *>(ptr) = r;
+			return 0;
+		}
+	}
+
+	int convert(const Plan &plan, Source src, View dst)
+	{
+		auto spmap = plan.src->pmap;
+		if (settings->pmap_mode == Settings::PMap::Disable)
+			spmap = nullptr;
+		auto dpmap = plan.dst->pmap;
+		for (auto & op : plan.ops) {
+			if (spmap && op.src->index >= 0 && !tll::scheme::pmap_get(src.view(spmap->offset).data(), op.src->index))
+				continue;
+			if (dpmap && op.dst->index >= 0)
+				tll_scheme_pmap_set(dst.view(dpmap->offset).data(), op.dst->index);
+			if (auto r = convert(op, src.view(op.src->offset), dst.view(op.dst->offset)); r)
+				return fail_field(r, op.dst);
+		}
+		return 0;
+	}
+
+	int convert(const Op &op, Source src, View dst)
+	{
+		switch (op.kind) {
+		case Op::Numeric:
+		case Op::Enum:
+			return op.numeric(*this, op, src.data(), dst.data());
+		case Op::Decimal128:
+			memcpy(dst.data(), src.data(), sizeof(tll::util::Decimal128));
+			return 0;
+		case Op::String:
+			return convert_string(op, src, dst);
+		case Op::Message:
+			return convert(*op.plan, src, dst);
+		case Op::List:
+			return convert_list(op, src, dst);
+		}
+		return 0;
+	}
+
+	int convert_string(const Op &op, Source src, View dst)
+	{
+		std::string_view str;
+		if (op.src->type == Field::Bytes) {
+			auto ptr = src.template dataT<const char>();
+			str = { ptr, op.src->sub_type == Field::ByteString ? strnlen(ptr, op.src->size) : op.src->size };
+		} else {
+			auto ptr = tll::scheme::read_pointer(op.src, src);
+			if (!ptr)
+				return fail(EINVAL, "Unknown offset ptr version: {}", op.src->offset_ptr_version);
+			if (src.size() < (size_t) ptr->offset + ptr->size)
+				return fail(EINVAL, "Offset string out of bounds: data size {}, string end {}", src.size(), ptr->offset + ptr->size);
+			str = { src.view(ptr->offset).template dataT<const char>(), ptr->size ? ptr->size - 1 : 0 };
+		}
+
+		if (op.dst->type == Field::Bytes) {
+			if (str.size() > op.dst->size) {
+				if (!trim)
+					return fail(ERANGE, "String too long: {} > max {}", str.size(), op.dst->size);
+				str = str.substr(0, op.dst->size);
+			}
+			memcpy(dst.data(), str.data(), str.size());
+			return 0;
+		}
+
+		tll::scheme::generic_offset_ptr_t ptr = {};
+		ptr.size = str.size() + 1;
+		ptr.entity = 1;
+		if (tll::scheme::alloc_pointer(op.dst, dst, ptr))
+			return fail(EINVAL, "Failed to allocate pointer");
+		auto view = dst.view(ptr.offset);
+		memcpy(view.data(), str.data(), str.size());
+		*view.view(str.size()).template dataT<char>() = '\0';
+		return 0;
+	}
+
+	int convert_list(const Op &op, Source src, View dst)
+	{
+		size_t size = 0;
+		size_t sstride = op.element->src->size;
+		auto sdata = src;
+		if (op.src->type == Field::Array) {
+			auto r = tll::scheme::read_size(op.src->count_ptr, src.view(op.src->count_ptr->offset));
+			if (r < 0 || (size_t) r > op.src->count)
+				return fail(EINVAL, "Invalid array size: {}", r);
+			size = r;
+			sdata = src.view(op.src->type_array->offset);
+		} else {
+			auto ptr = tll::scheme::read_pointer(op.src, src);
+			if (!ptr)
+				return fail(EINVAL, "Unknown offset ptr version: {}", op.src->offset_ptr_version);
+			if (src.size() < ptr->offset + ptr->entity * ptr->size)
+				return fail(EINVAL, "List size {} out of bounds: data size {}", ptr->offset + ptr->entity * ptr->size, src.size());
+			size = ptr->size;
+			sstride = ptr->entity;
+			sdata = src.view(ptr->offset);
+		}
+
+		size_t dstride = op.element->dst->size;
+		auto ddata = dst;
+		if (op.dst->type == Field::Array) {
+			if (size > op.dst->count)
+				return fail(ERANGE, "Array too long: {} > max {}", size, op.dst->count);
+			tll::scheme::write_size(op.dst->count_ptr, dst.view(op.dst->count_ptr->offset), size);
+			ddata = dst.view(op.dst->type_array->offset);
+		} else {
+			tll::scheme::generic_offset_ptr_t ptr = {};
+			ptr.size = size;
+			ptr.entity = dstride;
+			if (tll::scheme::alloc_pointer(op.dst, dst, ptr))
+				return fail(EINVAL, "Failed to allocate pointer");
+			ddata = dst.view(ptr.offset);
+		}
+
+		for (auto i = 0u; i < size; i++) {
+			if (auto r = convert(*op.element, sdata.view(sstride * i), ddata.view(dstride * i)); r)
+				return fail_index(r, i);
+		}
+		return 0;
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_CONVERT_H
@@ -8,6 +8,7 @@
 #ifndef _TLL_LUA_ENCODER_H
 #define _TLL_LUA_ENCODER_H
 
+#include "convert.h"
 #include "luat.h"
 #include "reflection.h"
 
@@ -19,6 +20,7 @@
 
 #include <cmath>
 #include <fmt/format.h>
+#include <unordered_map>
 
 namespace tll::lua {
 
@@ -29,6 +31,87 @@ struct Encoder : public tll::scheme::ErrorStack
 	Settings::Fixed fixed_mode = Settings::Fixed::Int;
 	Settings::Time time_mode = Settings::Time::Object;
 	enum class Overflow { Error, Trim } overflow_mode = Overflow::Error;
+	const SchemeIndex * index = nullptr;
+	Converter * converter = nullptr; ///< Native conversion of reflections from different scheme, disabled if null
+
+	/// Precompiled list of field steps for message: key slot in registry table and typed writer
+	struct Plan
+	{
+		using View = tll::memoryview<std::vector<char>>;
+		using Handler = int (Encoder::*)(const tll::scheme::Field *, View, lua_State *);
+
+		struct Step
+		{
+			const tll::scheme::Field * field;
+			int key; ///< Index of field name in keys table
+			Handler handler;
+		};
+
+		std::vector<Step> steps;
+	};
+
+	std::unordered_map<const tll::scheme::Message *, Plan> _plans;
+	int _plan_keys = LUA_NOREF; ///< Registry reference to the table with header keys and field names
+	int _plan_keys_size = 0;
+
+	/// Slots of message header keys in the keys table, filled when table is created
+	enum HeaderKey { KeyType = 1, KeySeq, KeyTime, KeyName, KeyMsgid, KeyAddr, KeyData };
+
+	/// Message name lookup tables, scheme is referenced so its address is not reused while cached
+	struct MessageNames
+	{
+		tll::scheme::ConstSchemePtr scheme;
+		NameIndex<tll::scheme::Message> names;
+	};
+	std::unordered_map<const tll::Scheme *, MessageNames> _message_names;
+	const tll::Scheme * _message_names_last = nullptr;
+	const NameIndex<tll::scheme::Message> * _message_names_last_index = nullptr;
+
+	/// Drop compiled plans and name caches, must be called when Lua state or scheme index is destroyed
+	void reset_plans()
+	{
+		_plans.clear();
+		_plan_keys = LUA_NOREF;
+		_plan_keys_size = 0;
+		_message_names.clear();
+		_message_names_last = nullptr;
+		_message_names_last_index = nullptr;
+	}
+
+	/// Push table with cached key strings, returns its stack index
+	int push_keys(lua_State * lua)
+	{
+		if (_plan_keys != LUA_NOREF) {
+			lua_rawgeti(lua, LUA_REGISTRYINDEX, _plan_keys);
+			return lua_gettop(lua);
+		}
+
+		lua_newtable(lua);
+		for (auto k : { "type", "seq", "time", "name", "msgid", "addr", "data" }) {
+			lua_pushstring(lua, k);
+			lua_rawseti(lua, -2, ++_plan_keys_size);
+		}
+		lua_pushvalue(lua, -1);
+		_plan_keys = luaL_ref(lua, LUA_REGISTRYINDEX);
+		return lua_gettop(lua);
+	}
+
+	/// Lookup message by name string at stack index, interned name strings are cached per scheme
+	const tll::scheme::Message * lookup_message(lua_State * lua, const tll::Scheme * scheme, int index)
+	{
+		if (lua_type(lua, index) != LUA_TSTRING)
+			return scheme->lookup(luaT_tostringview(lua, index));
+		if (scheme != _message_names_last) {
+			auto it = _message_names.find(scheme);
+			if (it == _message_names.end()) {
+				it = _message_names.emplace(scheme, MessageNames { tll::scheme::ConstSchemePtr(scheme->ref()) }).first;
+				it->second.names.build(scheme->messages);
+			}
+			_message_names_last = scheme;
+			_message_names_last_index = &it->second.names;
+		}
+		return _message_names_last_index->lookup(lua, index);
+	}
 
 	tll_msg_t * encode_data(lua_State * lua, tll_msg_t &msg, const tll::scheme::Message * message, int index)
 	{
@@ -46,6 +129,15 @@ struct Encoder : public tll::scheme::ErrorStack
 				msg.size = data->data.size();
 				return &msg;
 			}
+			if (converter) {
+				if (auto r = converter->convert(data->message, data->data, message, buf); r == 0) {
+					msg.msgid = message->msgid;
+					msg.data = buf.data();
+					msg.size = buf.size();
+					return &msg;
+				} else if (r != EAGAIN)
+					return fail(nullptr, "Failed to convert message {} at {}: {}", message->name, converter->format_stack(), converter->error);
+			}
 		} else if (!lua_istable(lua, index)) {
 			return fail(nullptr, "Invalid type of data: allowed string, table and Message");
 		}
@@ -84,8 +176,13 @@ struct Encoder : public tll::scheme::ErrorStack
 			if (args > index + 1)
 				return fail(nullptr, "Extra arguments not supported when using table: {} extra args", args - index - 1);
 
-			luaT_pushstringview(lua, "type");
-			if (auto type = lua_gettable(lua, index); type == LUA_TSTRING) {
+			const auto keys = push_keys(lua);
+			auto header = [lua, keys, index](HeaderKey key) {
+				lua_rawgeti(lua, keys, key);
+				return lua_gettable(lua, index);
+			};
+
+			if (auto type = header(KeyType); type == LUA_TSTRING) {
 				auto s = luaT_tostringview(lua, -1);
 				if (s == "Control")
 					msg.type = TLL_MESSAGE_CONTROL;
@@ -97,23 +194,20 @@ struct Encoder : public tll::scheme::ErrorStack
 			if (msg.type != TLL_MESSAGE_DATA)
 				scheme = channel->scheme(msg.type);
 
-			luaT_pushstringview(lua, "seq");
-			if (auto type = lua_gettable(lua, index); type == LUA_TNUMBER)
+			if (auto type = header(KeySeq); type == LUA_TNUMBER)
 				msg.seq = lua_tointeger(lua, -1);
 			lua_pop(lua, 1);
 
-			luaT_pushstringview(lua, "time");
-			if (auto type = lua_gettable(lua, index); type == LUA_TNUMBER)
+			if (auto type = header(KeyTime); type == LUA_TNUMBER)
 				msg.time = lua_tointeger(lua, -1);
 			lua_pop(lua, 1);
 
 			auto with_name = false;
-			luaT_pushstringview(lua, "name");
-			if (auto type = lua_gettable(lua, index); type == LUA_TSTRING) {
+			if (auto type = header(KeyName); type == LUA_TSTRING) {
 				with_name = true;
 				auto name = luaT_tostringview(lua, -1);
 				if (scheme) {
-					message = scheme->lookup(name);
+					message = lookup_message(lua, scheme, -1);
 					if (!message)
 						return fail(nullptr, "Message '{}' not found", name);
 					msg.msgid = message->msgid;
@@ -123,8 +217,7 @@ struct Encoder : public tll::scheme::ErrorStack
 				return fail(nullptr, "Invalid type of 'name' parameter: {}", type);
 			lua_pop(lua, 1);
 
-			luaT_pushstringview(lua, "msgid");
-			if (auto type = lua_gettable(lua, index); type == LUA_TNUMBER) {
+			if (auto type = header(KeyMsgid); type == LUA_TNUMBER) {
 				if (with_name)
 					return fail(nullptr, "Conflicting 'name' and 'msgid' parameters in table, need only one");
 				auto msgid = lua_tointeger(lua, -1);
@@ -138,19 +231,17 @@ struct Encoder : public tll::scheme::ErrorStack
 				return fail(nullptr, "Invalid type of 'msgid' parameter: {}", type);
 			lua_pop(lua, 1);
 
-			luaT_pushstringview(lua, "addr");
-			if (auto type = lua_gettable(lua, index); type == LUA_TNUMBER)
+			if (auto type = header(KeyAddr); type == LUA_TNUMBER)
 				msg.addr.i64 = lua_tointeger(lua, -1);
 			else if (type != LUA_TNIL)
 				return fail(nullptr, "Invalid type of 'addr' parameter: {}", type);
 			lua_pop(lua, 1);
 
-			luaT_pushstringview(lua, "data");
-			if (auto type = lua_gettable(lua, index); type != LUA_TNIL) {
+			if (auto type = header(KeyData); type != LUA_TNIL) {
 				if (auto r = encode_data(lua, msg, message, lua_gettop(lua)); !r)
 					return r;
 			}
-			lua_pop(lua, 1);
+			lua_pop(lua, 2);
 			return &msg;
 		}
 
@@ -174,7 +265,7 @@ struct Encoder : public tll::scheme::ErrorStack
 			auto name = luaT_tostringview(lua, index);
 			if (!scheme)
 				return fail(nullptr, "Message name '{}' without scheme", name);
-			message = scheme->lookup(name);
+			message = lookup_message(lua, scheme, index);
 			if (!message)
 				return fail(nullptr, "Message '{}' not found in scheme", name);
 			msg.msgid = message->msgid;
@@ -188,9 +279,148 @@ struct Encoder : public tll::scheme::ErrorStack
 		return encode_data(lua, msg, message, index);
 	}
 
+	/**
+	 * Overwrite field in existing message body with value on top of the stack
+	 *
+	 * Field is given by dot separated path, pmap bits are set on each level. Offset pointer
+	 * fields are allocated anew at the end of the buffer.
+	 */
+	template <typename Buf>
+	int patch(const tll::scheme::Message * message, Buf view, lua_State * lua, std::string_view path)
+	{
+		using Field = tll::scheme::Field;
+		for (;;) {
+			auto sep = path.find('.');
+			auto name = path.substr(0, sep);
+			const Field * field = nullptr;
+			if (auto fields = index ? index->fields(message) : nullptr; fields)
+				field = fields->lookup(name);
+			else
+				field = tll::scheme::lookup_name(message->fields, name);
+			if (!field)
+				return fail(ENOENT, "Field '{}' not found in message {}", name, message->name);
+
+			if (message->pmap)
+				tll_scheme_pmap_set(view.view(message->pmap->offset).data(), field->index);
+			view = view.view(field->offset);
+
+			if (sep == path.npos) {
+				if (auto r = encode(field, view, lua, lua_gettop(lua)); r)
+					return fail_field(r, field);
+				return 0;
+			}
+			if (field->type != Field::Message)
+				return fail(EINVAL, "Field '{}' is not a message in path", name);
+			message = field->type_msg;
+			path = path.substr(sep + 1);
+		}
+	}
+
+	/// Get or build encode plan, only messages from indexed schemes are compiled since they are kept alive
+	const Plan * lookup_plan(lua_State * lua, const tll::scheme::Message * message)
+	{
+		if (auto it = _plans.find(message); it != _plans.end())
+			return &it->second;
+		if (!index || !index->fields(message))
+			return nullptr;
+
+		push_keys(lua);
+		auto & plan = _plans[message];
+		for (auto f = message->fields; f; f = f->next) {
+			luaT_pushstringview(lua, f->name);
+			lua_rawseti(lua, -2, ++_plan_keys_size);
+			plan.steps.push_back({ f, _plan_keys_size, plan_handler(f) });
+		}
+		lua_pop(lua, 1);
+		return &plan;
+	}
+
+	static Plan::Handler plan_handler(const tll::scheme::Field * field)
+	{
+		using Field = tll::scheme::Field;
+		switch (field->type) {
+		case Field::Int8: return plan_numeric<int8_t>(field);
+		case Field::Int16: return plan_numeric<int16_t>(field);
+		case Field::Int32: return plan_numeric<int32_t>(field);
+		case Field::Int64: return plan_numeric<int64_t>(field);
+		case Field::UInt8: return plan_numeric<uint8_t>(field);
+		case Field::UInt16: return plan_numeric<uint16_t>(field);
+		case Field::UInt32: return plan_numeric<uint32_t>(field);
+		case Field::UInt64: return plan_numeric<uint64_t>(field);
+		case Field::Double: return plan_numeric<double>(field);
+		default:
+			break;
+		}
+		return &Encoder::encode_field<Plan::View>;
+	}
+
+	template <typename T>
+	static Plan::Handler plan_numeric(const tll::scheme::Field * field)
+	{
+		using Field = tll::scheme::Field;
+		switch (field->sub_type) {
+		case Field::Enum:
+			if constexpr (!std::is_same_v<double, T>)
+				return &Encoder::encode_enum<T, Plan::View>;
+			break;
+		case Field::Bits:
+			if constexpr (!std::is_same_v<double, T>)
+				return &Encoder::encode_bits<T, Plan::View>;
+			break;
+		case Field::Fixed:
+			if constexpr (!std::is_same_v<double, T>)
+				return &Encoder::encode_fixed<T, Plan::View>;
+			break;
+		case Field::TimePoint:
+			return &Encoder::encode_time_point<T, Plan::View>;
+		default:
+			break;
+		}
+		return &Encoder::encode_numeric_raw<T, Plan::View>;
+	}
+
+	int encode(const Plan &plan, const tll::scheme::Message * message, Plan::View view, lua_State * lua, int index)
+	{
+		// Objects with metatable can provide fields with __index, raw access only for plain tables
+		auto raw = lua_type(lua, index) == LUA_TTABLE;
+		if (raw && lua_getmetatable(lua, index)) {
+			lua_pop(lua, 1);
+			raw = false;
+		}
+
+		const auto keys = push_keys(lua);
+
+		auto pmap = message->pmap;
+		auto pmap_view = pmap ? view.view(pmap->offset) : view;
+		for (auto & step : plan.steps) {
+			lua_rawgeti(lua, keys, step.key);
+			if ((raw ? lua_rawget(lua, index) : lua_gettable(lua, index)) == LUA_TNIL) {
+				lua_pop(lua, 1);
+				continue;
+			}
+
+			if (pmap)
+				tll_scheme_pmap_set(pmap_view.data(), step.field->index);
+
+			auto r = (this->*step.handler)(step.field, view.view(step.field->offset), lua);
+			lua_pop(lua, 1);
+			if (r) {
+				lua_pop(lua, 1);
+				return fail_field(EINVAL, step.field);
+			}
+		}
+		lua_pop(lua, 1);
+		return 0;
+	}
+
 	template <typename Buf>
 	int encode(const tll::scheme::Message * message, Buf view, lua_State * lua, int index)
 	{
+		if constexpr (std::is_same_v<Buf, Plan::View>) {
+			if (auto plan = lookup_plan(lua, message); plan)
+				return encode(*plan, message, view, lua, index);
+		}
+
 		auto pmap = message->pmap;
 		auto pmap_view = pmap ? view.view(pmap->offset) : view;
 		for (auto f = message->fields; f; f = f->next) {
@@ -216,6 +446,13 @@ struct Encoder : public tll::scheme::ErrorStack
 	int encode(const tll::scheme::Field * field, Buf view, lua_State * lua, int index)
 	{
 		using Field = tll::scheme::Field;
+		if (field->type == Field::Message || field->type == Field::Array || field->type == Field::Pointer) {
+			if (lua_type(lua, -1) == LUA_TUSERDATA) {
+				if (auto r = encode_reflection(field, view, lua); r != EAGAIN)
+					return r;
+			}
+		}
+
 		switch (field->type) {
 		case Field::Int8: return encode_numeric<int8_t>(field, view, lua);
 		case Field::Int16: return encode_numeric<int16_t>(field, view, lua);
@@ -347,6 +584,136 @@ struct Encoder : public tll::scheme::ErrorStack
 		return 0;
 	}
 
+	enum class Layout { Plain, Pointers, Unsupported };
+
+	/// Check if field can be copied as is or offset pointers need to be rebased
+	static Layout layout(const tll::scheme::Field * field)
+	{
+		using Field = tll::scheme::Field;
+		switch (field->type) {
+		case Field::Pointer: {
+			auto r = layout(field->type_ptr);
+			return r == Layout::Unsupported ? r : Layout::Pointers;
+		}
+		case Field::Array:
+			return layout(field->type_array);
+		case Field::Message: {
+			auto r = Layout::Plain;
+			for (auto f = field->type_msg->fields; f; f = f->next) {
+				auto l = layout(f);
+				if (l == Layout::Unsupported)
+					return l;
+				if (l == Layout::Pointers)
+					r = l;
+			}
+			return r;
+		}
+		case Field::Union:
+			for (auto i = 0u; i < field->type_union->fields_size; i++) {
+				if (layout(field->type_union->fields + i) != Layout::Plain)
+					return Layout::Unsupported;
+			}
+			return Layout::Plain;
+		default:
+			return Layout::Plain;
+		}
+	}
+
+	/**
+	 * Copy raw bytes of reflection object that has same layout as the field
+	 *
+	 * @return EAGAIN if value is not a compatible reflection and has to be encoded field by field
+	 */
+	template <typename Buf>
+	int encode_reflection(const tll::scheme::Field * field, Buf view, lua_State * lua)
+	{
+		using Field = tll::scheme::Field;
+		const tll::memoryview<const tll_msg_t> * src = nullptr;
+		if (field->type == Field::Message) {
+			auto r = luaT_testudata<reflection::Message>(lua, -1);
+			if (!r || r->message != field->type_msg)
+				return EAGAIN;
+			src = &r->data;
+		} else {
+			auto r = luaT_testudata<reflection::Array>(lua, -1);
+			if (!r || r->field != field)
+				return EAGAIN;
+			src = &r->data;
+		}
+
+		auto l = layout(field);
+		if (l == Layout::Unsupported)
+			return EAGAIN;
+		if (field->type != Field::Pointer)
+			memcpy(view.data(), src->data(), field->size);
+		if (l == Layout::Plain)
+			return 0;
+		if (copy_pointers(field, view, *src))
+			return fail(EINVAL, "Failed to copy offset pointer data");
+		return 0;
+	}
+
+	/// Copy data of offset pointers from source, pointers are allocated in the buffer and rebased
+	template <typename Buf, typename Src>
+	int copy_pointers(const tll::scheme::Field * field, Buf view, Src src)
+	{
+		using Field = tll::scheme::Field;
+		switch (field->type) {
+		case Field::Message:
+			for (auto f = field->type_msg->fields; f; f = f->next) {
+				if (layout(f) == Layout::Plain)
+					continue;
+				if (auto r = copy_pointers(f, view.view(f->offset), src.view(f->offset)); r)
+					return r;
+			}
+			return 0;
+		case Field::Array: {
+			auto af = field->type_array;
+			if (layout(af) == Layout::Plain)
+				return 0;
+			auto size = tll::scheme::read_size(field->count_ptr, src.view(field->count_ptr->offset));
+			if (size < 0 || (size_t) size > field->count)
+				return EINVAL;
+			for (auto i = 0u; i < (size_t) size; i++) {
+				if (auto r = copy_pointers(af, view.view(af->offset + af->size * i), src.view(af->offset + af->size * i)); r)
+					return r;
+			}
+			return 0;
+		}
+		case Field::Pointer: {
+			auto ptr = tll::scheme::read_pointer(field, src);
+			if (!ptr)
+				return EINVAL;
+			if (src.size() < (size_t) ptr->offset + (size_t) ptr->size * ptr->entity)
+				return EINVAL;
+			tll::scheme::generic_offset_ptr_t dst = {};
+			dst.size = ptr->size;
+			dst.entity = ptr->entity;
+			if (tll::scheme::alloc_pointer(field, view, dst))
+				return EINVAL;
+			auto dview = view.view(dst.offset);
+			auto sview = src.view(ptr->offset);
+			memcpy(dview.data(), sview.data(), dst.size * dst.entity);
+			if (layout(field->type_ptr) == Layout::Plain)
+				return 0;
+			for (auto i = 0u; i < dst.size; i++) {
+				if (auto r = copy_pointers(field->type_ptr, dview.view(dst.entity * i), sview.view(dst.entity * i)); r)
+					return r;
+			}
+			return 0;
+		}
+		default:
+			return 0;
+		}
+	}
+
+	/// Encode value on top of the stack, used for non-scalar fields in encode plan
+	template <typename Buf>
+	int encode_field(const tll::scheme::Field * field, Buf view, lua_State * lua)
+	{
+		return encode(field, view, lua, lua_gettop(lua));
+	}
+
 	template <typename T, typename Buf>
 	int encode_bits(const tll::scheme::Field * field, Buf view, lua_State * lua)
 	{
@@ -399,7 +766,12 @@ struct Encoder : public tll::scheme::ErrorStack
 			return fail(EINVAL, "Non-Enum userdata");
 		} else if (type == LUA_TSTRING) {
 			auto str = luaT_tostringview(lua, -1);
-			if (auto v = tll::scheme::lookup_name(field->type_enum->values, str); v) {
+			const tll_scheme_enum_value_t * v = nullptr;
+			if (auto e = index ? index->enums(field->type_enum) : nullptr; e)
+				v = e->lookup(str);
+			else
+				v = tll::scheme::lookup_name(field->type_enum->values, str);
+			if (v) {
 				*ptr = v->value;
 				return 0;
 			}
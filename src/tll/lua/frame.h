@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_FRAME_H
+#define _TLL_LUA_FRAME_H
+
+#include "tll/lua/luat.h"
+
+#include <tll/channel.h>
+
+#include <fmt/format.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace tll::lua {
+
+/**
+ * Native frame packer compiled from ``string.pack`` format
+ *
+ * Supported subset of format: endianness ``<``, ``>``, ``=``, integers ``b``, ``h``, ``i[n]``,
+ * ``l``, ``j``, ``T`` and their unsigned variants with size up to 8 bytes, fixed strings ``cN`` and
+ * padding ``x``. Each item except padding is bound to a value from ``frame_fields`` table: name
+ * of message field (``size``, ``msgid``, ``seq`` or ``addr``) or constant that is written on pack
+ * and ignored on unpack. Message size can be bound only to unsigned item.
+ */
+class FrameFormat
+{
+ public:
+	enum class Field { Const, Size, MsgId, Seq, Addr };
+
+	struct Item
+	{
+		size_t offset = 0;
+		unsigned size = 0;
+		bool is_signed = false;
+		bool string = false; ///< Fixed size string, only constant values
+		Field field = Field::Const;
+		long long value = 0;
+		std::string data; ///< Constant string value, padded with zeroes
+	};
+
+	std::vector<Item> items;
+	size_t size = 0;
+	bool little = true;
+	std::string error;
+
+	/// Parse format string, returns non-zero on error and sets ``error``
+	int init(std::string_view format)
+	{
+		items.clear();
+		size = 0;
+		little = _native_little();
+
+		for (size_t i = 0; i < format.size();) {
+			auto c = format[i++];
+			Item item;
+			switch (c) {
+			case ' ': continue;
+			case '<': little = true; continue;
+			case '>': little = false; continue;
+			case '=': little = _native_little(); continue;
+			case 'x': size++; continue;
+			case 'b': case 'B': item.size = 1; break;
+			case 'h': case 'H': item.size = 2; break;
+			case 'l': case 'L': case 'j': case 'J': case 'T': item.size = 8; break;
+			case 'i': case 'I': item.size = _number(format, i, 4); break;
+			case 'c':
+				item.string = true;
+				item.size = _number(format, i, 0);
+				if (!item.size)
+					return _fail("Missing size for 'c' at {}", i - 1);
+				break;
+			default:
+				return _fail("Unsupported format option '{}' at {}", c, i - 1);
+			}
+			if (!item.string && (item.size == 0 || item.size > 8))
+				return _fail("Invalid integer size {} at {}", item.size, i - 1);
+			item.is_signed = c == 'b' || c == 'h' || c == 'i' || c == 'l' || c == 'j';
+			item.offset = size;
+			size += item.size;
+			items.push_back(std::move(item));
+		}
+		return 0;
+	}
+
+	/// Bind items to values from table at index, returns non-zero on error and sets ``error``
+	int bind(lua_State * lua, int index)
+	{
+		if (!lua_istable(lua, index))
+			return _fail("Frame fields is not a table");
+		if ((size_t) luaL_len(lua, index) != items.size())
+			return _fail("Frame fields count {} does not match format items count {}", luaL_len(lua, index), items.size());
+
+		bool has_size = false;
+		for (size_t i = 0; i < items.size(); i++) {
+			auto & item = items[i];
+			lua_geti(lua, index, i + 1);
+			if (item.string) {
+				if (lua_type(lua, -1) != LUA_TSTRING) {
+					lua_pop(lua, 1);
+					return _fail("Field {}: only string constant allowed for 'c' item", i + 1);
+				}
+				auto s = luaT_tostringview(lua, -1);
+				if (s.size() > item.size) {
+					lua_pop(lua, 1);
+					return _fail("Field {}: string constant is longer than {} bytes", i + 1, item.size);
+				}
+				item.data = std::string(s);
+				item.data.resize(item.size, '\0');
+			} else if (lua_isinteger(lua, -1)) {
+				item.value = lua_tointeger(lua, -1);
+				if (!_fits(item, item.value)) {
+					lua_pop(lua, 1);
+					return _fail("Field {}: constant {} does not fit into {} bytes", i + 1, item.value, item.size);
+				}
+			} else if (lua_type(lua, -1) == LUA_TSTRING) {
+				auto s = luaT_tostringview(lua, -1);
+				if (s == "size") {
+					if (item.is_signed) {
+						lua_pop(lua, 1);
+						return _fail("Field {}: message size can not be bound to signed item", i + 1);
+					}
+					item.field = Field::Size;
+					has_size = true;
+				} else if (s == "msgid")
+					item.field = Field::MsgId;
+				else if (s == "seq")
+					item.field = Field::Seq;
+				else if (s == "addr")
+					item.field = Field::Addr;
+				else {
+					lua_pop(lua, 1);
+					return _fail("Field {}: unknown message field '{}'", i + 1, s);
+				}
+			} else {
+				lua_pop(lua, 1);
+				return _fail("Field {}: expected integer or string, got {}", i + 1, lua_typename(lua, lua_type(lua, -1)));
+			}
+			lua_pop(lua, 1);
+		}
+		if (!has_size)
+			return _fail("No item is bound to message size");
+		return 0;
+	}
+
+	/// Write frame for message into buffer of ``size`` bytes, returns non-zero if value does not fit
+	int pack(const tll_msg_t * msg, char * buf) const
+	{
+		memset(buf, 0, size);
+		for (auto & item : items) {
+			if (item.string) {
+				memcpy(buf + item.offset, item.data.data(), item.size);
+				continue;
+			}
+			auto v = _get(item, msg);
+			if (!_fits(item, v))
+				return ERANGE;
+			for (unsigned i = 0; i < item.size; i++) {
+				auto shift = 8 * (little ? i : item.size - i - 1);
+				buf[item.offset + i] = (char) ((uint64_t) v >> shift);
+			}
+		}
+		return 0;
+	}
+
+	/// Fill message fields from frame, size is not checked against buffer limits
+	void unpack(const char * buf, tll_msg_t * msg) const
+	{
+		for (auto & item : items) {
+			if (item.string || item.field == Field::Const)
+				continue;
+			uint64_t v = 0;
+			for (unsigned i = 0; i < item.size; i++) {
+				auto shift = 8 * (little ? i : item.size - i - 1);
+				v |= (uint64_t) (unsigned char) buf[item.offset + i] << shift;
+			}
+			if (item.is_signed && item.size < 8 && (v >> (8 * item.size - 1)) & 1)
+				v |= ~0ull << (8 * item.size);
+			_set(item, msg, (long long) v);
+		}
+	}
+
+ private:
+	template <typename... Args>
+	int _fail(std::string_view format, const Args & ... args)
+	{
+		error = fmt::vformat(format, fmt::make_format_args(args...));
+		return EINVAL;
+	}
+
+	static bool _native_little()
+	{
+		const uint16_t v = 1;
+		return *(const char *) &v;
+	}
+
+	static unsigned _number(std::string_view s, size_t &i, unsigned def)
+	{
+		if (i >= s.size() || s[i] < '0' || s[i] > '9')
+			return def;
+		unsigned r = 0;
+		for (; i < s.size() && s[i] >= '0' && s[i] <= '9' && r < 1024; i++)
+			r = r * 10 + (s[i] - '0');
+		return r;
+	}
+
+	static bool _fits(const Item &item, long long v)
+	{
+		if (item.size >= 8)
+			return true;
+		const auto bits = 8 * item.size;
+		if (item.is_signed)
+			return v >= -(1ll << (bits - 1)) && v < (1ll << (bits - 1));
+		return v >= 0 && v < (1ll << bits);
+	}
+
+	static long long _get(const Item &item, const tll_msg_t * msg)
+	{
+		switch (item.field) {
+		case Field::Const: return item.value;
+		case Field::Size: return msg->size;
+		case Field::MsgId: return msg->msgid;
+		case Field::Seq: return msg->seq;
+		case Field::Addr: return msg->addr.i64;
+		}
+		return 0;
+	}
+
+	static void _set(const Item &item, tll_msg_t * msg, long long v)
+	{
+		switch (item.field) {
+		case Field::Const: break;
+		case Field::Size: msg->size = v; break;
+		case Field::MsgId: msg->msgid = v; break;
+		case Field::Seq: msg->seq = v; break;
+		case Field::Addr: msg->addr.i64 = v; break;
+		}
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_FRAME_H
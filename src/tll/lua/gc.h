@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_GC_H
+#define _TLL_LUA_GC_H
+
+#include "tll/lua/luat.h"
+
+#include <tll/util/time.h>
+
+namespace tll::lua {
+
+/**
+ * Garbage collector policy of Lua state
+ *
+ * In ``Auto`` mode Lua runs incremental collector steps inside allocations, which happens during
+ * message hooks. ``Idle`` mode stops automatic collector and runs steps when channel has nothing
+ * else to do, ``Manual`` leaves collection completely to the script.
+ */
+struct GcPolicy
+{
+	enum class Mode { Auto, Idle, Manual };
+
+	Mode mode = Mode::Auto;
+	int step = 0; ///< Size of idle step in kilobytes, zero for basic step
+	int pause = 200; ///< Memory growth in percents after finished cycle before next idle cycle
+
+	int threshold = 0; ///< Memory size in kilobytes when next idle cycle is started
+	bool running = false; ///< Idle cycle is started and not finished yet
+
+	void init(lua_State * lua)
+	{
+		threshold = 0;
+		running = false;
+		if (mode != Mode::Auto)
+			lua_gc(lua, LUA_GCSTOP, 0);
+	}
+
+	/// Check if idle collector has work to do, memory reached threshold or cycle is in progress
+	bool pending(lua_State * lua) const
+	{
+		return mode == Mode::Idle && (running || lua_gc(lua, LUA_GCCOUNT, 0) >= threshold);
+	}
+
+	/// Run collector step in idle mode, returns zero duration if step was not needed
+	tll::duration idle(lua_State * lua)
+	{
+		if (mode != Mode::Idle)
+			return {};
+		if (!running && lua_gc(lua, LUA_GCCOUNT, 0) < threshold)
+			return {};
+		auto start = tll::time::now();
+		running = true;
+		if (lua_gc(lua, LUA_GCSTEP, step)) { // Cycle is finished
+			running = false;
+			threshold = lua_gc(lua, LUA_GCCOUNT, 0) * pause / 100;
+		}
+		return tll::time::now() - start;
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_GC_H
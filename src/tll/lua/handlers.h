@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_HANDLERS_H
+#define _TLL_LUA_HANDLERS_H
+
+#include "tll/lua/luat.h"
+
+#include <tll/scheme.h>
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tll::lua {
+
+/**
+ * Global Lua function resolved into registry reference
+ *
+ * Calling hook through reference avoids string hashing and globals table lookup on each message.
+ * Script can replace functions at runtime and request new lookup with ``tll_rebind_hooks()``.
+ */
+struct Hook
+{
+	std::string name;
+	int ref = LUA_NOREF;
+
+	explicit operator bool () const { return ref != LUA_NOREF; }
+
+	/// Lookup global function, previous reference is released
+	bool bind(lua_State * lua)
+	{
+		reset(lua);
+		if (lua_getglobal(lua, name.c_str()) != LUA_TFUNCTION) {
+			lua_pop(lua, 1);
+			return false;
+		}
+		ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+		return true;
+	}
+
+	/// Release reference, lua can be null if state is already closed
+	void reset(lua_State * lua)
+	{
+		if (lua && ref != LUA_NOREF)
+			luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+		ref = LUA_NOREF;
+	}
+
+	void push(lua_State * lua) const { lua_rawgeti(lua, LUA_REGISTRYINDEX, ref); }
+};
+
+/**
+ * Per-message Lua handlers named ``<prefix><MessageName>``
+ *
+ * Small non-negative message ids are looked up in plain vector, other ids in hash map.
+ * Entries are created for all messages so rebind can pick up functions defined later.
+ */
+class MessageHandlers
+{
+ public:
+	using Handler = Hook;
+
+	static constexpr int dense_max = 4096;
+
+	bool empty() const { return _size == 0; }
+	size_t size() const { return _size; }
+
+	const Handler * lookup(int msgid) const
+	{
+		if (msgid >= 0 && msgid < (int) _dense.size()) {
+			auto & h = _dense[msgid];
+			return h ? &h : nullptr;
+		}
+		if (_sparse.empty())
+			return nullptr;
+		auto it = _sparse.find(msgid);
+		return it == _sparse.end() || !it->second ? nullptr : &it->second;
+	}
+
+	/// Check if there are any global functions with given prefix, used when scheme is not yet known
+	static bool defined(lua_State * lua, std::string_view prefix)
+	{
+		auto guard = StackGuard(lua);
+		lua_pushglobaltable(lua);
+		lua_pushnil(lua);
+		while (lua_next(lua, -2)) {
+			if (lua_type(lua, -2) == LUA_TSTRING && lua_isfunction(lua, -1)) {
+				auto name = luaT_tostringview(lua, -2);
+				if (name.size() > prefix.size() && name.substr(0, prefix.size()) == prefix && name != "tll_on_data_batch")
+					return true;
+			}
+			lua_pop(lua, 1);
+		}
+		return false;
+	}
+
+	/// Resolve handlers for all messages of the scheme, previous handlers are released
+	void build(lua_State * lua, const tll::Scheme * scheme, std::string_view prefix)
+	{
+		reset(lua);
+		if (!scheme)
+			return;
+		for (auto m = scheme->messages; m; m = m->next) {
+			if (!m->msgid)
+				continue;
+			Handler h = { std::string(prefix) + m->name };
+			if (m->msgid >= 0 && m->msgid < dense_max) {
+				if (_dense.size() <= (size_t) m->msgid)
+					_dense.resize(m->msgid + 1);
+				_dense[m->msgid] = std::move(h);
+			} else
+				_sparse[m->msgid] = std::move(h);
+		}
+		rebind(lua);
+	}
+
+	/// Lookup functions again, handler objects are not moved so it is safe to call from inside the hook
+	void rebind(lua_State * lua)
+	{
+		_size = 0;
+		for (auto & h : _dense) {
+			if (!h.name.empty() && h.bind(lua))
+				_size++;
+		}
+		for (auto & [_, h] : _sparse) {
+			if (h.bind(lua))
+				_size++;
+		}
+	}
+
+	/// Release references, lua can be null if state is already closed
+	void reset(lua_State * lua)
+	{
+		for (auto & h : _dense)
+			h.reset(lua);
+		for (auto & [_, h] : _sparse)
+			h.reset(lua);
+		_dense.clear();
+		_sparse.clear();
+		_size = 0;
+	}
+
+ private:
+	std::vector<Handler> _dense;
+	std::unordered_map<int, Handler> _sparse;
+	size_t _size = 0;
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_HANDLERS_H
@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_INDEX_H
+#define _TLL_LUA_INDEX_H
+
+#include "tll/lua/luat.h"
+
+#include <tll/scheme.h>
+
+#include <algorithm>
+#include <list>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tll::lua {
+
+/// Registry key for the table that keeps cached Lua key strings alive
+inline const char lua_key_anchor = 0;
+
+/**
+ * Open addressing name -> descriptor table for scheme linked lists (fields, bits, enum values)
+ *
+ * Lookups from Lua additionally use a cache keyed by the address of the interned key string.
+ * Cached strings are anchored in the registry so the address can not be reused while cache
+ * is valid, cache must be reset when Lua state is closed.
+ */
+template <typename T>
+class NameIndex
+{
+	struct Entry
+	{
+		size_t hash = 0;
+		std::string_view name;
+		const T * value = nullptr;
+	};
+
+	struct CacheEntry
+	{
+		const char * key = nullptr;
+		const T * value = nullptr;
+	};
+
+	static constexpr size_t short_string_max = 40; // LUAI_MAXSHORTLEN, longer strings are not interned
+
+	std::vector<Entry> _table;
+	mutable std::vector<CacheEntry> _cache;
+	size_t _mask = 0;
+
+	size_t _cache_slot(const char * key) const { return (((uintptr_t) key * 0x9e3779b97f4a7c15ull) >> 32) & _mask; }
+
+ public:
+	static size_t hash(std::string_view s)
+	{
+		size_t r = 0xcbf29ce484222325ull; // FNV-1a
+		for (auto c : s)
+			r = (r ^ (unsigned char) c) * 0x100000001b3ull;
+		return r;
+	}
+
+	void build(const T * list)
+	{
+		size_t count = 0;
+		for (auto i = list; i; i = i->next)
+			count++;
+		size_t size = 4;
+		while (size < 2 * count)
+			size *= 2;
+		_mask = size - 1;
+		_table.clear();
+		_table.resize(size);
+		_cache.clear();
+		_cache.resize(size);
+		for (auto i = list; i; i = i->next) {
+			auto h = hash(i->name);
+			auto idx = h & _mask;
+			while (_table[idx].value)
+				idx = (idx + 1) & _mask;
+			_table[idx] = { h, i->name, i };
+		}
+	}
+
+	const T * lookup(std::string_view name) const
+	{
+		if (_table.empty())
+			return nullptr;
+		auto h = hash(name);
+		for (auto idx = h & _mask; ; idx = (idx + 1) & _mask) {
+			auto & e = _table[idx];
+			if (!e.value)
+				return nullptr;
+			if (e.hash == h && e.name == name)
+				return e.value;
+		}
+	}
+
+	/// Lookup string at Lua stack index, nullptr if key is not a string or not found
+	const T * lookup(lua_State * lua, int index) const
+	{
+		size_t size = 0;
+		auto key = lua_tolstring(lua, index, &size);
+		if (!key || _table.empty())
+			return nullptr;
+		index = lua_absindex(lua, index); // Anchor table is pushed before the key
+		auto idx = _cache_slot(key);
+		size_t probe = 0;
+		for (; probe <= _mask && _cache[idx].key; probe++, idx = (idx + 1) & _mask) {
+			if (_cache[idx].key == key)
+				return _cache[idx].value;
+		}
+
+		auto r = lookup(std::string_view(key, size));
+		if (!r || size > short_string_max)
+			return r;
+		if (probe > _mask) // Cache is full (index is shared between states), use string lookup
+			return r;
+
+		if (lua_rawgetp(lua, LUA_REGISTRYINDEX, &lua_key_anchor) != LUA_TTABLE) {
+			lua_pop(lua, 1);
+			lua_newtable(lua);
+			lua_pushvalue(lua, -1);
+			lua_rawsetp(lua, LUA_REGISTRYINDEX, &lua_key_anchor);
+		}
+		lua_pushvalue(lua, index);
+		lua_pushboolean(lua, 1);
+		lua_rawset(lua, -3);
+		lua_pop(lua, 1);
+
+		_cache[idx] = { key, r }; // Probe loop stopped on the free slot
+		return r;
+	}
+
+	void reset_cache() const
+	{
+		for (auto & e : _cache)
+			e = {};
+	}
+};
+
+/// Enum values indexed both by name and by value
+struct EnumIndex
+{
+	NameIndex<tll_scheme_enum_value_t> names;
+	std::vector<const tll_scheme_enum_value_t *> values; // Sorted by value
+
+	void build(const tll::scheme::Enum * desc)
+	{
+		names.build(desc->values);
+		values.clear();
+		for (auto v = desc->values; v; v = v->next)
+			values.push_back(v);
+		std::stable_sort(values.begin(), values.end(), [](auto & l, auto & r) { return l->value < r->value; });
+	}
+
+	const tll_scheme_enum_value_t * lookup(std::string_view name) const { return names.lookup(name); }
+	const tll_scheme_enum_value_t * lookup(long long value) const
+	{
+		auto it = std::lower_bound(values.begin(), values.end(), value, [](auto & l, long long r) { return l->value < r; });
+		if (it == values.end() || (*it)->value != value)
+			return nullptr;
+		return *it;
+	}
+};
+
+/**
+ * Lookup tables for all messages, bits and enums of attached schemes.
+ *
+ * Built once when scheme is attached to the channel, schemes are referenced
+ * so descriptor pointers stay valid until index is cleared.
+ */
+class SchemeIndex
+{
+	std::list<tll::scheme::ConstSchemePtr> _schemes;
+	std::unordered_map<const tll::scheme::Message *, NameIndex<tll::scheme::Field>> _messages;
+	std::unordered_map<const tll::scheme::BitFields *, NameIndex<tll_scheme_bit_field_t>> _bits;
+	std::unordered_map<const tll::scheme::Enum *, EnumIndex> _enums;
+
+ public:
+	void add(const tll::Scheme * scheme)
+	{
+		if (!scheme)
+			return;
+		for (auto & s : _schemes) {
+			if (s.get() == scheme)
+				return;
+		}
+		_schemes.emplace_back(scheme->ref());
+		for (auto m = scheme->messages; m; m = m->next)
+			_add(m);
+	}
+
+	const std::list<tll::scheme::ConstSchemePtr> & schemes() const { return _schemes; }
+
+	void clear()
+	{
+		_messages.clear();
+		_bits.clear();
+		_enums.clear();
+		_schemes.clear();
+	}
+
+	const NameIndex<tll::scheme::Field> * fields(const tll::scheme::Message * message) const
+	{
+		auto it = _messages.find(message);
+		return it == _messages.end() ? nullptr : &it->second;
+	}
+
+	const NameIndex<tll_scheme_bit_field_t> * bits(const tll::scheme::BitFields * bits) const
+	{
+		auto it = _bits.find(bits);
+		return it == _bits.end() ? nullptr : &it->second;
+	}
+
+	const EnumIndex * enums(const tll::scheme::Enum * desc) const
+	{
+		auto it = _enums.find(desc);
+		return it == _enums.end() ? nullptr : &it->second;
+	}
+
+ private:
+	void _add(const tll::scheme::Message * message)
+	{
+		if (_messages.find(message) != _messages.end())
+			return;
+		_messages[message].build(message->fields);
+		for (auto f = message->fields; f; f = f->next)
+			_add(f);
+	}
+
+	void _add(const tll::scheme::Field * field)
+	{
+		using Field = tll::scheme::Field;
+		if (field->sub_type == Field::Enum && field->type_enum) {
+			if (_enums.find(field->type_enum) == _enums.end())
+				_enums[field->type_enum].build(field->type_enum);
+		} else if (field->sub_type == Field::Bits && field->type_bits) {
+			if (_bits.find(field->type_bits) == _bits.end())
+				_bits[field->type_bits].build(field->type_bits->values);
+		}
+
+		switch (field->type) {
+		case Field::Message:
+			_add(field->type_msg);
+			break;
+		case Field::Array:
+			_add(field->type_array);
+			break;
+		case Field::Pointer:
+			_add(field->type_ptr);
+			break;
+		case Field::Union:
+			for (auto i = 0u; i < field->type_union->fields_size; i++)
+				_add(field->type_union->fields + i);
+			break;
+		default:
+			break;
+		}
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_INDEX_H
@@ -205,4 +205,32 @@ inline std::string_view luaT_tostringview(lua_State * lua, int index)
 
 inline const char * luaT_pushstringview(lua_State * lua, std::string_view s) { return lua_pushlstring(lua, s.data(), s.size()); }
 
+/**
+ * Call function on top of the stack with arguments pushed by ``push(lua)`` inside protected call
+ *
+ * Memory errors while pushing arguments (for example when allocator limit is reached) are returned
+ * as ``lua_pcall`` error instead of Lua panic. If ``push`` returns negative value function is not
+ * called, ``nresults`` nils are left on the stack and -1 is returned.
+ */
+template <typename F>
+int luaT_pcallpush(lua_State * lua, int nresults, F push)
+{
+	struct Args { F * push; int nresults; bool failed; } args = { &push, nresults, false };
+	lua_pushcfunction(lua, [](lua_State * lua) -> int {
+		auto args = static_cast<Args *>(lua_touserdata(lua, 2));
+		lua_settop(lua, 1);
+		auto n = (*args->push)(lua);
+		if (n < 0) {
+			args->failed = true;
+			return 0;
+		}
+		lua_call(lua, n, args->nresults);
+		return args->nresults;
+	});
+	lua_insert(lua, -2);
+	lua_pushlightuserdata(lua, &args);
+	auto r = lua_pcall(lua, 2, nresults, 0);
+	return args.failed ? -1 : r;
+}
+
 #endif//_TLL_LUA_LUAT_H
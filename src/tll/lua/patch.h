@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_PATCH_H
+#define _TLL_LUA_PATCH_H
+
+#include "tll/lua/encoder.h"
+#include "tll/lua/luat.h"
+#include "tll/lua/reflection.h"
+
+#include <vector>
+
+namespace tll::lua {
+
+/// Owned message body, referenced from user value of patched reflection
+struct MessageBuffer
+{
+	tll_msg_t msg = {};
+	std::vector<char> data;
+};
+
+template <>
+struct MetaT<MessageBuffer> : public MetaBase
+{
+	static constexpr std::string_view name = "tll_msg_buffer";
+
+	static int gc(lua_State* lua)
+	{
+		auto & self = luaT_checkuserdata<MessageBuffer>(lua, 1);
+		self.~MessageBuffer();
+		return 0;
+	}
+};
+
+/**
+ * Implementation of ``tll_msg_patch(msg, table)``
+ *
+ * Copy binary body of reflection and overwrite only fields listed in the table. Keys are field
+ * names or dot separated paths to fields of nested messages, like ``header.ts``. Returns new
+ * reflection object that holds patched copy.
+ */
+inline int msg_patch(lua_State * lua, Encoder &encoder)
+{
+	auto src = luaT_testudata<reflection::Message>(lua, 1);
+	if (!src)
+		return luaL_error(lua, "First argument must be message reflection");
+	luaL_checktype(lua, 2, LUA_TTABLE);
+	lua_settop(lua, 2);
+
+	auto buffer = new (lua_newuserdata(lua, sizeof(MessageBuffer))) MessageBuffer();
+	luaL_setmetatable(lua, MetaT<MessageBuffer>::name.data());
+
+	auto data = static_cast<const char *>(src->data.data());
+	buffer->data.assign(data, data + src->data.size());
+	auto view = tll::make_view(buffer->data);
+
+	lua_pushnil(lua);
+	while (lua_next(lua, 2)) {
+		if (lua_type(lua, -2) != LUA_TSTRING)
+			return luaL_error(lua, "Non-string key in patch table");
+		if (encoder.patch(src->message, view, lua, luaT_tostringview(lua, -2)))
+			return luaL_error(lua, "Failed to patch field %s: %s", lua_tostring(lua, -2), encoder.error.c_str());
+		lua_pop(lua, 1);
+	}
+
+	buffer->msg.msgid = src->message->msgid;
+	buffer->msg.data = buffer->data.data();
+	buffer->msg.size = buffer->data.size();
+
+	luaT_push(lua, reflection::Message { src->message, tll::make_view(static_cast<const tll_msg_t &>(buffer->msg)), src->settings });
+	lua_createtable(lua, 1, 0);
+	lua_pushvalue(lua, 3);
+	lua_rawseti(lua, -2, 0); // Field pointers used as keys for cached children are never zero
+	lua_setuservalue(lua, -2);
+	return 1;
+}
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_PATCH_H
@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_PROFILE_H
+#define _TLL_LUA_PROFILE_H
+
+#include "tll/lua/luat.h"
+
+#include <fmt/format.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+
+namespace tll::lua {
+
+/**
+ * Sampling profiler for Lua code
+ *
+ * Count hook is installed with ``lua_sethook`` and fires each ``interval`` VM instructions.
+ * On each sample Lua stack is converted into folded string ``outer;...;inner`` where frame is
+ * ``name (source:line)`` and number of samples is accumulated for each unique stack.
+ * Result is written in folded stack format that is accepted by flamegraph tools.
+ */
+class Profiler
+{
+ public:
+	static constexpr int depth_max = 64;
+
+	int interval = 10000;
+	size_t samples = 0;
+
+	/// Install hook, pointer to profiler is kept in state extra space
+	void attach(lua_State * lua)
+	{
+		*static_cast<Profiler **>(lua_getextraspace(lua)) = this;
+		lua_sethook(lua, _hook, LUA_MASKCOUNT, interval);
+	}
+
+	void detach(lua_State * lua)
+	{
+		lua_sethook(lua, nullptr, 0, 0);
+		*static_cast<Profiler **>(lua_getextraspace(lua)) = nullptr;
+	}
+
+	void clear()
+	{
+		_stacks.clear();
+		samples = 0;
+	}
+
+	/// Write folded stacks into file, returns errno on failure
+	int dump(const std::string &filename) const
+	{
+		auto tmp = filename + ".tmp";
+		auto f = fopen(tmp.c_str(), "w");
+		if (!f)
+			return errno;
+		for (auto & [stack, count] : _stacks)
+			fmt::print(f, "{} {}\n", stack, count);
+		if (fclose(f)) {
+			remove(tmp.c_str());
+			return EIO;
+		}
+		if (rename(tmp.c_str(), filename.c_str()))
+			return errno;
+		return 0;
+	}
+
+	const std::unordered_map<std::string, size_t> & stacks() const { return _stacks; }
+
+ private:
+	std::unordered_map<std::string, size_t> _stacks;
+	std::string _buf; ///< Reused key buffer, map is only extended for new stacks
+
+	void _sample(lua_State * lua)
+	{
+		lua_Debug frames[depth_max];
+		int depth = 0;
+		for (; depth < depth_max; depth++) {
+			if (!lua_getstack(lua, depth, &frames[depth]))
+				break;
+		}
+
+		_buf.clear();
+		for (auto i = depth - 1; i >= 0; i--) {
+			auto & ar = frames[i];
+			if (!lua_getinfo(lua, "Sln", &ar))
+				continue;
+			if (_buf.size())
+				_buf.push_back(';');
+			if (ar.name) // Functions called from C (hooks) have no name
+				_buf.append(ar.name);
+			else if (*ar.what == 'm')
+				_buf.append("main");
+			else
+				fmt::format_to(std::back_inserter(_buf), "function <{}:{}>", ar.short_src, ar.linedefined);
+			if (*ar.what == 'C')
+				_buf.append(" [C]");
+			else
+				fmt::format_to(std::back_inserter(_buf), " ({}:{})", ar.short_src, ar.currentline);
+		}
+		if (_buf.empty())
+			return;
+
+		samples++;
+		if (auto it = _stacks.find(_buf); it != _stacks.end())
+			it->second++;
+		else
+			_stacks.emplace(_buf, 1);
+	}
+
+	static void _hook(lua_State * lua, lua_Debug * ar)
+	{
+		if (ar->event != LUA_HOOKCOUNT)
+			return;
+		if (auto self = *static_cast<Profiler **>(lua_getextraspace(lua)); self)
+			self->_sample(lua);
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_PROFILE_H
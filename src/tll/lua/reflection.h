@@ -8,6 +8,7 @@
 #ifndef _TLL_LUA_REFLECTION_H
 #define _TLL_LUA_REFLECTION_H
 
+#include "index.h"
 #include "luat.h"
 #include "tll/lua/time.h"
 
@@ -33,6 +34,37 @@ struct Settings
 	enum class Decimal128 { Float, Object } decimal128_mode = Decimal128::Float;
 	enum class Time { Int, Float, Object, String } time_mode = Time::Object;
 	bool deepcopy = false;
+	bool reflection_cache = false; ///< Reuse child Message/Array/Union objects stored in parent user value
+	const SchemeIndex * index = nullptr; ///< Optional lookup index, linear scan is used if not set
+
+	using PushField = int (*)(lua_State *, const tll::scheme::Field *, tll::memoryview<const tll_msg_t>, const Settings &, int, lua_Integer);
+	PushField pushfield = nullptr; ///< Field pusher specialized for current modes, generic one is used if not set
+};
+
+/// Field representation modes taken from settings at runtime
+struct RuntimeModes
+{
+	static Settings::Enum enum_mode(const Settings &s) { return s.enum_mode; }
+	static Settings::Bits bits_mode(const Settings &s) { return s.bits_mode; }
+	static Settings::Fixed fixed_mode(const Settings &s) { return s.fixed_mode; }
+	static Settings::Decimal128 decimal128_mode(const Settings &s) { return s.decimal128_mode; }
+	static Settings::Time time_mode(const Settings &s) { return s.time_mode; }
+};
+
+/// Field representation modes fixed at compile time, used to specialize pushers for presets
+template <Settings::Enum E, Settings::Bits B, Settings::Fixed F, Settings::Decimal128 D, Settings::Time T>
+struct StaticModes
+{
+	static constexpr Settings::Enum enum_mode(const Settings &) { return E; }
+	static constexpr Settings::Bits bits_mode(const Settings &) { return B; }
+	static constexpr Settings::Fixed fixed_mode(const Settings &) { return F; }
+	static constexpr Settings::Decimal128 decimal128_mode(const Settings &) { return D; }
+	static constexpr Settings::Time time_mode(const Settings &) { return T; }
+
+	static bool match(const Settings &s)
+	{
+		return s.enum_mode == E && s.bits_mode == B && s.fixed_mode == F && s.decimal128_mode == D && s.time_mode == T;
+	}
 };
 
 struct Message
@@ -55,14 +87,28 @@ struct Message
 	const tll::scheme::Message * message = nullptr;
 	tll::memoryview<const tll_msg_t> data;
 	const Settings & settings;
+	mutable const NameIndex<tll::scheme::Field> * index = nullptr;
 
 	const tll::scheme::Field * lookup(std::string_view name) const
 	{
+		if (!index && settings.index)
+			index = settings.index->fields(message);
+		if (index)
+			return index->lookup(name);
 		for (auto f = message->fields; f; f = f->next)
 			if (f->name == name)
 				return f;
 		return nullptr;
 	}
+
+	const tll::scheme::Field * lookup(lua_State * lua, int key) const
+	{
+		if (!index && settings.index)
+			index = settings.index->fields(message);
+		if (index)
+			return index->lookup(lua, key);
+		return lookup(luaT_checkstringview(lua, key));
+	}
 };
 
 struct Union
@@ -93,7 +139,7 @@ struct Array
 		}
 	}
 
-	int push(lua_State* lua, int key);
+	int push(lua_State* lua, int key, int self = 0);
 };
 
 struct Bits
@@ -101,14 +147,28 @@ struct Bits
 	const tll::scheme::Field * field = nullptr;
 	tll::memoryview<const tll_msg_t> data;
 	const Settings &settings;
+	mutable const NameIndex<tll_scheme_bit_field_t> * index = nullptr;
 
 	const tll_scheme_bit_field_t * lookup(std::string_view name) const
 	{
+		if (!index && settings.index && field->type_bits)
+			index = settings.index->bits(field->type_bits);
+		if (index)
+			return index->lookup(name);
 		for (auto f = field->bitfields; f; f = f->next)
 			if (f->name == name)
 				return f;
 		return nullptr;
 	}
+
+	const tll_scheme_bit_field_t * lookup(lua_State * lua, int key) const
+	{
+		if (!index && settings.index && field->type_bits)
+			index = settings.index->bits(field->type_bits);
+		if (index)
+			return index->lookup(lua, key);
+		return lookup(luaT_checkstringview(lua, key));
+	}
 };
 
 struct Decimal128
@@ -145,6 +205,7 @@ struct Enum
 {
 	const tll::scheme::Enum * desc = nullptr;
 	long long value;
+	const EnumIndex * index = nullptr;
 
 	static const tll_scheme_enum_value_t * lookup(const tll::scheme::Enum * desc, long long value)
 	{
@@ -154,7 +215,72 @@ struct Enum
 		return nullptr;
 	}
 
-	const tll_scheme_enum_value_t * lookup(long long value) { return lookup(desc, value); }
+	static const tll_scheme_enum_value_t * lookup(const tll::scheme::Enum * desc, long long value, const SchemeIndex * index)
+	{
+		if (auto e = index ? index->enums(desc) : nullptr; e)
+			return e->lookup(value);
+		return lookup(desc, value);
+	}
+
+	const tll_scheme_enum_value_t * lookup(long long value) { return index ? index->lookup(value) : lookup(desc, value); }
+	const tll_scheme_enum_value_t * lookup(std::string_view name) { return index ? index->lookup(name) : tll::scheme::lookup_name(desc->values, name); }
+};
+
+/// Replace reflection object stored in userdata at index with new value, no allocation is done
+template <typename T>
+void reinit(lua_State * lua, int index, T && value)
+{
+	auto ptr = luaT_touserdata<T>(lua, index);
+	if constexpr (std::is_same_v<T, Message>) {
+		if (ptr->message == value.message)
+			value.index = ptr->index;
+	}
+	ptr->~T();
+	new (ptr) T(std::move(value));
+}
+
+/**
+ * Pool of top level reflection objects, one per nested callback level.
+ *
+ * Objects are kept in registry and reinitialized for each message, so together with
+ * child cache in user values message access is allocation free.
+ */
+struct Pool
+{
+	std::vector<int> refs;
+	unsigned depth = 0;
+
+	struct Scope
+	{
+		Pool * pool;
+		~Scope() { pool->depth--; }
+	};
+
+	/// Enter callback level, object pushed on this level is valid until scope is destroyed
+	Scope scope() { depth++; return { this }; }
+
+	int push(lua_State * lua, Message && value)
+	{
+		if (depth == 0) {
+			luaT_push(lua, std::move(value));
+			return 1;
+		}
+		if (refs.size() < depth)
+			refs.resize(depth, LUA_NOREF);
+		auto & ref = refs[depth - 1];
+		if (ref != LUA_NOREF) {
+			lua_rawgeti(lua, LUA_REGISTRYINDEX, ref);
+			reinit(lua, -1, std::move(value));
+			return 1;
+		}
+		luaT_push(lua, std::move(value));
+		lua_pushvalue(lua, -1);
+		ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+		return 1;
+	}
+
+	/// Forget references, called when Lua state is closed
+	void reset() { refs.clear(); }
 };
 } // namespace reflection
 
@@ -167,7 +293,7 @@ inline constexpr unsigned long long intpow(unsigned base, unsigned pow)
 	return r;
 }
 
-template <typename View, typename T>
+template <typename Modes = RuntimeModes, typename View, typename T>
 int pushtime(lua_State * lua, const tll::scheme::Field * field, View data, T v, const Settings & settings)
 {
 	if (field->sub_type == field->TimePoint) {
@@ -182,7 +308,7 @@ int pushtime(lua_State * lua, const tll::scheme::Field * field, View data, T v,
 			ts.type = TimePoint::Unsigned;
 			ts.vsigned = v;
 		}
-		switch (settings.time_mode) {
+		switch (Modes::time_mode(settings)) {
 		case Settings::Time::Int:
 			if constexpr (std::is_floating_point_v<T>)
 				lua_pushnumber(lua, v);
@@ -206,11 +332,11 @@ int pushtime(lua_State * lua, const tll::scheme::Field * field, View data, T v,
 	return 1;
 }
 
-template <typename View, typename T>
+template <typename Modes = RuntimeModes, typename View, typename T>
 int pushnumber(lua_State * lua, const tll::scheme::Field * field, View data, T v, const Settings & settings)
 {
 	if (field->sub_type == field->Bits) {
-		switch (settings.bits_mode) {
+		switch (Modes::bits_mode(settings)) {
 		case Settings::Bits::Int:
 			lua_pushinteger(lua, v);
 			break;
@@ -219,22 +345,22 @@ int pushnumber(lua_State * lua, const tll::scheme::Field * field, View data, T v
 			break;
 		}
 	} else if (field->sub_type == field->Enum) {
-		switch (settings.enum_mode) {
+		switch (Modes::enum_mode(settings)) {
 		case Settings::Enum::Int:
 			lua_pushinteger(lua, v);
 			break;
 		case Settings::Enum::String:
-			if (auto e = reflection::Enum::lookup(field->type_enum, v); e)
+			if (auto e = reflection::Enum::lookup(field->type_enum, v, settings.index); e)
 				lua_pushstring(lua, e->name);
 			else
 				return luaL_error(lua, "Invalid enum %s value %d", field->name, v);
 			break;
 		case Settings::Enum::Object:
-			luaT_push<reflection::Enum>(lua, { field->type_enum, (long long) v });
+			luaT_push<reflection::Enum>(lua, { field->type_enum, (long long) v, settings.index ? settings.index->enums(field->type_enum) : nullptr });
 			break;
 		}
 	} else if (field->sub_type == field->Fixed) {
-		switch (settings.fixed_mode) {
+		switch (Modes::fixed_mode(settings)) {
 		case Settings::Fixed::Int:
 			lua_pushinteger(lua, v);
 			break;
@@ -246,17 +372,17 @@ int pushnumber(lua_State * lua, const tll::scheme::Field * field, View data, T v
 			break;
 		}
 	} else if (field->sub_type == field->TimePoint) {
-		return pushtime(lua, field, data, v, settings);
+		return pushtime<Modes>(lua, field, data, v, settings);
 	} else
 		lua_pushinteger(lua, v);
 	return 1;
 }
 
-template <typename View>
+template <typename Modes = RuntimeModes, typename View>
 int pushdouble(lua_State * lua, const tll::scheme::Field * field, View data, double v, const Settings &settings)
 {
 	if (field->sub_type == field->TimePoint)
-		return pushtime(lua, field, data, v, settings);
+		return pushtime<Modes>(lua, field, data, v, settings);
 	lua_pushnumber(lua, v);
 	return 1;
 }
@@ -264,22 +390,56 @@ int pushdouble(lua_State * lua, const tll::scheme::Field * field, View data, dou
 template <typename View>
 int pushcopy(lua_State *lua, const tll::scheme::Message * message, View data, const Settings & settings);
 
-template <typename View>
-int pushfield(lua_State * lua, const tll::scheme::Field * field, View data, const Settings & settings)
+/// Push child object, reusing userdata cached in user value of parent object if parent is not zero
+template <typename T>
+int pushchild(lua_State * lua, int parent, lua_Integer key, T && value)
+{
+	if (!parent) {
+		luaT_push<T>(lua, std::move(value));
+		return 1;
+	}
+	if (lua_getuservalue(lua, parent) != LUA_TTABLE) {
+		lua_pop(lua, 1);
+		lua_newtable(lua);
+		lua_pushvalue(lua, -1);
+		lua_setuservalue(lua, parent);
+	}
+	if (lua_rawgeti(lua, -1, key) == LUA_TUSERDATA) {
+		reflection::reinit<T>(lua, -1, std::move(value));
+	} else {
+		lua_pop(lua, 1);
+		luaT_push<T>(lua, std::move(value));
+		lua_pushvalue(lua, -1);
+		lua_rawseti(lua, -3, key);
+	}
+	lua_remove(lua, -2);
+	return 1;
+}
+
+/**
+ * Push field value, representation modes are taken from ``Modes`` policy
+ *
+ * If reflection cache is enabled and parent object index is given then nested objects are stored in
+ * parent user value under ``key``: field pointer for message or union members and index for arrays.
+ */
+template <typename Modes, typename View>
+int pushfieldT(lua_State * lua, const tll::scheme::Field * field, View data, const Settings & settings, int parent = 0, lua_Integer key = 0)
 {
 	using tll::scheme::Field;
+	if (!settings.reflection_cache)
+		parent = 0;
 	switch (field->type) {
-	case Field::Int8:  return pushnumber(lua, field, data, *data.template dataT<int8_t>(), settings);
-	case Field::Int16: return pushnumber(lua, field, data, *data.template dataT<int16_t>(), settings);
-	case Field::Int32: return pushnumber(lua, field, data, *data.template dataT<int32_t>(), settings);
-	case Field::Int64: return pushnumber(lua, field, data, *data.template dataT<int64_t>(), settings);
-	case Field::UInt8:  return pushnumber(lua, field, data, *data.template dataT<uint8_t>(), settings);
-	case Field::UInt16: return pushnumber(lua, field, data, *data.template dataT<uint16_t>(), settings);
-	case Field::UInt32: return pushnumber(lua, field, data, *data.template dataT<uint32_t>(), settings);
-	case Field::UInt64: return pushnumber(lua, field, data, *data.template dataT<uint64_t>(), settings);
-	case Field::Double: return pushdouble(lua, field, data, *data.template dataT<double>(), settings);
+	case Field::Int8:  return pushnumber<Modes>(lua, field, data, *data.template dataT<int8_t>(), settings);
+	case Field::Int16: return pushnumber<Modes>(lua, field, data, *data.template dataT<int16_t>(), settings);
+	case Field::Int32: return pushnumber<Modes>(lua, field, data, *data.template dataT<int32_t>(), settings);
+	case Field::Int64: return pushnumber<Modes>(lua, field, data, *data.template dataT<int64_t>(), settings);
+	case Field::UInt8:  return pushnumber<Modes>(lua, field, data, *data.template dataT<uint8_t>(), settings);
+	case Field::UInt16: return pushnumber<Modes>(lua, field, data, *data.template dataT<uint16_t>(), settings);
+	case Field::UInt32: return pushnumber<Modes>(lua, field, data, *data.template dataT<uint32_t>(), settings);
+	case Field::UInt64: return pushnumber<Modes>(lua, field, data, *data.template dataT<uint64_t>(), settings);
+	case Field::Double: return pushdouble<Modes>(lua, field, data, *data.template dataT<double>(), settings);
 	case Field::Decimal128:
-		switch (settings.decimal128_mode) {
+		switch (Modes::decimal128_mode(settings)) {
 		case Settings::Decimal128::Float:
 			reflection::Decimal128::pushfloat(lua, *data.template dataT<tll::util::Decimal128>());
 			break;
@@ -307,11 +467,11 @@ int pushfield(lua_State * lua, const tll::scheme::Field * field, View data, cons
 			lua_newtable(lua);
 			for (auto i = 0u; i < size; i++) {
 				lua_pushinteger(lua, i + 1);
-				pushfield(lua, f, data.view(f->offset + f->size * i), settings);
+				pushfieldT<Modes>(lua, f, data.view(f->offset + f->size * i), settings);
 				lua_settable(lua, -3);
 			}
 		} else
-			luaT_push<reflection::Array>(lua, { field, data, settings });
+			pushchild<reflection::Array>(lua, parent, key, { field, data, settings });
 		break;
 	case Field::Pointer:
 		if (field->sub_type == Field::ByteString) {
@@ -330,17 +490,17 @@ int pushfield(lua_State * lua, const tll::scheme::Field * field, View data, cons
 			lua_newtable(lua);
 			for (auto i = 0u; i < ptr->size; i++) {
 				lua_pushinteger(lua, i + 1);
-				pushfield(lua, field->type_ptr, data.view(ptr->offset + ptr->entity * i), settings);
+				pushfieldT<Modes>(lua, field->type_ptr, data.view(ptr->offset + ptr->entity * i), settings);
 				lua_settable(lua, -3);
 			}
 		} else
-			luaT_push<reflection::Array>(lua, { field, data, settings });
+			pushchild<reflection::Array>(lua, parent, key, { field, data, settings });
 		break;
 	case Field::Message:
 		if (settings.deepcopy)
 			pushcopy(lua, field->type_msg, data, settings);
 		else
-			luaT_push<reflection::Message>(lua, { field->type_msg, data, settings });
+			pushchild<reflection::Message>(lua, parent, key, { field->type_msg, data, settings });
 		break;
 	case Field::Union:
 		if (settings.deepcopy) {
@@ -358,15 +518,26 @@ int pushfield(lua_State * lua, const tll::scheme::Field * field, View data, cons
 			luaT_pushstringview(lua, f->name);
 			lua_settable(lua, -3);
 			luaT_pushstringview(lua, f->name);
-			pushfield(lua, f, data.view(field->offset), settings);
+			pushfieldT<Modes>(lua, f, data.view(field->offset), settings);
 			lua_settable(lua, -3);
 		} else
-			luaT_push<reflection::Union>(lua, { field->type_union, data, settings });
+			pushchild<reflection::Union>(lua, parent, key, { field->type_union, data, settings });
 		break;
 	}
 	return 1;
 }
 
+/// Push field value, uses pusher specialized for settings preset if it is set, see ``select_pushfield``
+template <typename View>
+int pushfield(lua_State * lua, const tll::scheme::Field * field, View data, const Settings & settings, int parent = 0, lua_Integer key = 0)
+{
+	if constexpr (std::is_same_v<View, tll::memoryview<const tll_msg_t>>) {
+		if (settings.pushfield)
+			return settings.pushfield(lua, field, data, settings, parent, key);
+	}
+	return pushfieldT<RuntimeModes>(lua, field, data, settings, parent, key);
+}
+
 template <typename View>
 int pushcopy(lua_State *lua, const tll::scheme::Message * message, View data, const Settings & settings)
 {
@@ -385,6 +556,23 @@ int pushcopy(lua_State *lua, const tll::scheme::Message * message, View data, co
 	}
 	return 1;
 }
+
+using FilterModes = StaticModes<Settings::Enum::String, Settings::Bits::Object, Settings::Fixed::Float, Settings::Decimal128::Float, Settings::Time::Object>;
+using ConvertModes = StaticModes<Settings::Enum::String, Settings::Bits::Object, Settings::Fixed::Object, Settings::Decimal128::Object, Settings::Time::Object>;
+using ConvertFastModes = StaticModes<Settings::Enum::Int, Settings::Bits::Int, Settings::Fixed::Int, Settings::Decimal128::Object, Settings::Time::Int>;
+
+/// Select pusher specialized for one of the presets, nullptr if modes are custom
+inline Settings::PushField select_pushfield(const Settings &settings)
+{
+	using View = tll::memoryview<const tll_msg_t>;
+	if (FilterModes::match(settings))
+		return pushfieldT<FilterModes, View>;
+	if (ConvertModes::match(settings))
+		return pushfieldT<ConvertModes, View>;
+	if (ConvertFastModes::match(settings))
+		return pushfieldT<ConvertFastModes, View>;
+	return nullptr;
+}
 } // namespace reflection
 
 template <>
@@ -434,12 +622,12 @@ struct MetaT<reflection::Message> : public MetaBase
 	static int index(lua_State* lua)
 	{
 		auto & r = *luaT_touserdata<reflection::Message>(lua, 1);
-		auto key = luaT_checkstringview(lua, 2);
 
 		if (r.data.size() < r.message->size)
 			return luaL_error(lua, "Message '%s' size %d > data size %d", r.message->name, r.message->size, r.data.size());
-		auto field = r.lookup(key);
+		auto field = r.lookup(lua, 2);
 		if (field == nullptr) {
+			auto key = luaT_checkstringview(lua, 2);
 			if (r.settings.child_mode == Settings::Child::Strict)
 				return luaL_error(lua, "Message '%s' has no field '%s'", r.message->name, key.data());
 			lua_pushnil(lua);
@@ -453,7 +641,7 @@ struct MetaT<reflection::Message> : public MetaBase
 				return 1;
 			}
 		}
-		return pushfield(lua, field, r.data.view(field->offset), r.settings);
+		return pushfield(lua, field, r.data.view(field->offset), r.settings, 1, (intptr_t) field);
 	}
 
 	static int pairs(lua_State* lua)
@@ -536,7 +724,7 @@ struct MetaT<reflection::Union> : public MetaBase
 		if (key == "_tll_type")
 			luaT_pushstringview(lua, field->name);
 		else if (key == field->name)
-			pushfield(lua, field, r.data.view(field->offset), r.settings);
+			pushfield(lua, field, r.data.view(field->offset), r.settings, 1, (intptr_t) field);
 		else
 			lua_pushnil(lua);
 		return 1;
@@ -552,7 +740,7 @@ struct MetaT<reflection::Array> : public MetaBase
 		auto & r = *luaT_touserdata<reflection::Array>(lua, 1);
 		auto key = luaL_checkinteger(lua, 2);
 
-		return r.push(lua, key);
+		return r.push(lua, key, 1);
 	}
 
 	static int ipairs(lua_State* lua) { return pairs(lua); }
@@ -572,7 +760,7 @@ struct MetaT<reflection::Array> : public MetaBase
 		if (key > r.size(lua))
 			return 0;
 		lua_pushinteger(lua, key);
-		return r.push(lua, key) + 1;
+		return r.push(lua, key, 1) + 1;
 	}
 
 	static int len(lua_State* lua)
@@ -584,7 +772,7 @@ struct MetaT<reflection::Array> : public MetaBase
 	}
 };
 
-inline int reflection::Array::push(lua_State* lua, int key)
+inline int reflection::Array::push(lua_State* lua, int key, int self)
 {
 	auto idx = key - 1; // Lua counts from 1, not from zero
 	if (field->type == tll::scheme::Field::Array) {
@@ -596,7 +784,7 @@ inline int reflection::Array::push(lua_State* lua, int key)
 		auto f = field->type_array;
 		if (data.size() < f->offset + f->size * f->count)
 			return luaL_error(lua, "Array '%s' size %d > data size %d", field->name, f->offset + f->size * f->count, data.size());
-		return pushfield(lua, f, data.view(f->offset + f->size * idx), settings);
+		return pushfield(lua, f, data.view(f->offset + f->size * idx), settings, self, key);
 	} else {
 		auto ptr = tll::scheme::read_pointer(field, data);
 		if (!ptr)
@@ -605,7 +793,7 @@ inline int reflection::Array::push(lua_State* lua, int key)
 			return luaL_error(lua, "Array %s index out of bounds (size %d): %d", field->name, ptr->size, key);
 		if (data.size() < ptr->offset + ptr->entity * ptr->size)
 			return luaL_error(lua, "Array '%s' size %d > data size %d", field->name, ptr->offset + ptr->entity * ptr->size, data.size());
-		return pushfield(lua, field->type_ptr, data.view(ptr->offset + ptr->entity * idx), settings);
+		return pushfield(lua, field->type_ptr, data.view(ptr->offset + ptr->entity * idx), settings, self, key);
 	}
 }
 
@@ -616,10 +804,10 @@ struct MetaT<reflection::Bits> : public MetaBase
 	static int index(lua_State* lua)
 	{
 		auto & r = *luaT_touserdata<reflection::Bits>(lua, 1);
-		auto key = luaT_checkstringview(lua, 2);
 
-		auto bit = r.lookup(key);
+		auto bit = r.lookup(lua, 2);
 		if (bit == nullptr) {
+			auto key = luaT_checkstringview(lua, 2);
 			if (r.settings.child_mode == Settings::Child::Strict)
 				return luaL_error(lua, "Bits '%s' has no bit '%s'", r.field->name, key.data());
 			lua_pushnil(lua);
@@ -788,7 +976,7 @@ struct MetaT<reflection::Enum> : public MetaBase
 			lua_pushboolean(lua, self.value == lua_tointeger(lua, 2));
 			break;
 		case LUA_TSTRING:
-			if (auto r = tll::scheme::lookup_name(self.desc->values, luaT_tostringview(lua, 2)); r)
+			if (auto r = self.lookup(luaT_tostringview(lua, 2)); r)
 				lua_pushboolean(lua, self.value == r->value);
 			else
 				lua_pushboolean(lua, 0);
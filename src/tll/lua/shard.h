@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: MIT
+// SPDX-FileCopyrightText: Pavel Shramov <shramov@mexmat.net>
+
+#ifndef _TLL_LUA_SHARD_H
+#define _TLL_LUA_SHARD_H
+
+#include "tll/lua/alloc.h"
+#include "tll/lua/encoder.h"
+#include "tll/lua/handlers.h"
+#include "tll/lua/index.h"
+#include "tll/lua/luat.h"
+#include "tll/lua/patch.h"
+#include "tll/lua/profile.h"
+#include "tll/lua/reflection.h"
+
+#include <tll/channel.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace tll::lua {
+
+/// Bounded lock-free queue with single producer and single consumer
+template <typename T>
+class SpscQueue
+{
+	std::vector<T> _data;
+	size_t _mask = 0;
+	alignas(64) std::atomic<size_t> _head = { 0 }; ///< Consumer position
+	alignas(64) std::atomic<size_t> _tail = { 0 }; ///< Producer position
+
+ public:
+	explicit SpscQueue(size_t size)
+	{
+		size_t s = 1;
+		while (s < size)
+			s <<= 1;
+		_data.resize(s);
+		_mask = s - 1;
+	}
+
+	bool push(T && v)
+	{
+		auto tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head.load(std::memory_order_acquire) == _data.size())
+			return false;
+		_data[tail & _mask] = std::move(v);
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	T * front()
+	{
+		auto head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return nullptr;
+		return &_data[head & _mask];
+	}
+
+	void pop() { _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+};
+
+/// Message produced by the script in worker thread, data is owned by the output
+struct ShardOutput
+{
+	enum Target { Pass = -1, Callback = 0, Post = 1, Other = 2 }; ///< Other is non-data message deferred by channel
+	int target = Callback;
+	tll_msg_t msg = {};
+	std::vector<char> data;
+
+	ShardOutput() = default;
+	ShardOutput(int t, const tll_msg_t * m) : target(t), msg(*m), data((const char *) m->data, (const char *) m->data + m->size) {}
+};
+
+struct ShardJob
+{
+	uint64_t order = 0; ///< Position in input stream, used to restore ordering
+	ShardOutput message;
+};
+
+struct ShardResult
+{
+	uint64_t order = 0;
+	std::vector<ShardOutput> outputs;
+	std::string error; ///< Hook failure, empty on success
+};
+
+/**
+ * Worker thread with its own Lua state
+ *
+ * State, scheme index and encoder are owned by the worker and are touched only from worker thread
+ * after start. Jobs are processed by handler given by the channel, messages that are created
+ * by the script with output functions (``tll_callback`` and similar) are collected in the result
+ * and delivered by channel thread.
+ */
+struct ShardWorker
+{
+	using Handler = void (*)(void * user, ShardWorker &, ShardJob &, ShardResult &);
+
+	struct Target
+	{
+		const tll::Scheme * scheme = nullptr;
+		const tll::Channel * channel = nullptr;
+	};
+
+	unsigned id = 0;
+	Allocator alloc; ///< Declared before state so it outlives it
+	LuaRc lua;
+	Settings settings;
+	SchemeIndex index;
+	Encoder encoder;
+	Hook hook; ///< Common data hook, may be unbound if only per-message handlers are defined
+	MessageHandlers handlers; ///< Per-message ``tll_on_data_<Name>`` hooks
+	bool filter = false; ///< Hook result is used as filter decision
+	const tll::Scheme * scheme = nullptr; ///< Input scheme
+	const tll::Channel * channel = nullptr; ///< Input channel
+	std::array<Target, 2> targets; ///< Schemes and channels for Callback and Post outputs
+
+	SpscQueue<ShardJob> input;
+	SpscQueue<ShardResult> output;
+	std::deque<ShardJob> overflow; ///< Jobs that did not fit into input queue, touched only by channel thread
+
+	Handler handler = nullptr;
+	void * user = nullptr;
+
+	ShardResult * result = nullptr; ///< Result of current job, output functions append to it
+
+	std::unique_ptr<Profiler> profiler; ///< Separate profiler for worker state, null if disabled
+	std::string profile_file;
+
+	ShardWorker(unsigned i, size_t size) : id(i), input(size), output(size) {}
+	~ShardWorker() { stop(); }
+
+	void start()
+	{
+		_stop = false;
+		_thread = std::thread([this]() { run(); });
+	}
+
+	void stop()
+	{
+		_stop = true;
+		if (_thread.joinable())
+			_thread.join();
+	}
+
+	/// Register Lua function that encodes message and appends it to the current result
+	void add_output(lua_State * lua, const char * name, ShardOutput::Target target)
+	{
+		lua_pushlightuserdata(lua, this);
+		lua_pushinteger(lua, target);
+		lua_pushcclosure(lua, _lua_output, 2);
+		lua_setglobal(lua, name);
+	}
+
+	/// Register batch variant of output function, list elements are encoded one by one
+	void add_output_batch(lua_State * lua, const char * name, ShardOutput::Target target)
+	{
+		lua_pushlightuserdata(lua, this);
+		lua_pushinteger(lua, target);
+		lua_pushcclosure(lua, _lua_output_batch, 2);
+		lua_setglobal(lua, name);
+	}
+
+	/// Register helper functions that use worker data instead of the channel
+	void add_helpers(lua_State * lua)
+	{
+		lua_pushlightuserdata(lua, this);
+		lua_pushcclosure(lua, _lua_msg_patch, 1);
+		lua_setglobal(lua, "tll_msg_patch");
+
+		lua_pushlightuserdata(lua, this);
+		lua_pushcclosure(lua, _lua_rebind_hooks, 1);
+		lua_setglobal(lua, "tll_rebind_hooks");
+
+		lua_pushlightuserdata(lua, this);
+		lua_pushcclosure(lua, _lua_profile_dump, 1);
+		lua_setglobal(lua, "tll_profile_dump");
+
+		add_output(lua, "tll_callback", ShardOutput::Callback);
+		add_output_batch(lua, "tll_callback_batch", ShardOutput::Callback);
+	}
+
+	/// Resolve common hook and per-message handlers, returns false if nothing is defined
+	bool bind(lua_State * lua)
+	{
+		if (!hook.name.empty())
+			hook.bind(lua);
+		handlers.rebind(lua);
+		return hook || !handlers.empty();
+	}
+
+	void run()
+	{
+		unsigned idle = 0;
+		while (!_stop.load(std::memory_order_relaxed)) {
+			auto job = input.front();
+			if (!job) {
+				_backoff(idle++);
+				continue;
+			}
+			idle = 0;
+
+			ShardResult r;
+			r.order = job->order;
+			result = &r;
+			handler(user, *this, *job, r);
+			result = nullptr;
+			input.pop();
+
+			while (!output.push(std::move(r))) {
+				if (_stop.load(std::memory_order_relaxed))
+					return;
+				_backoff(idle++);
+			}
+			idle = 0;
+		}
+	}
+
+ private:
+	std::atomic<bool> _stop = { false };
+	std::thread _thread;
+
+	static void _backoff(unsigned idle)
+	{
+		if (idle < 64)
+			return;
+		if (idle < 128)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+
+	static ShardWorker * _lua_self(lua_State * lua)
+	{
+		return static_cast<ShardWorker *>(lua_touserdata(lua, lua_upvalueindex(1)));
+	}
+
+	static int _lua_output(lua_State * lua)
+	{
+		auto self = _lua_self(lua);
+		auto target = (ShardOutput::Target) lua_tointeger(lua, lua_upvalueindex(2));
+		if (!self || !self->result)
+			return luaL_error(lua, "Output function called outside of message hook");
+		auto & t = self->targets[target];
+		auto msg = self->encoder.encode_stack(lua, t.scheme, t.channel, 0);
+		if (!msg)
+			return luaL_error(lua, "Failed to convert message: %s", self->encoder.error.c_str());
+		self->result->outputs.emplace_back(target, msg);
+		return 0;
+	}
+
+	static int _lua_output_batch(lua_State * lua)
+	{
+		auto self = _lua_self(lua);
+		auto target = (ShardOutput::Target) lua_tointeger(lua, lua_upvalueindex(2));
+		if (!self || !self->result)
+			return luaL_error(lua, "Output function called outside of message hook");
+		luaL_checktype(lua, 1, LUA_TTABLE);
+		auto & t = self->targets[target];
+		auto size = luaL_len(lua, 1);
+		for (auto i = 1; i <= size; i++) {
+			lua_settop(lua, 1);
+			lua_rawgeti(lua, 1, i);
+			auto msg = self->encoder.encode_stack(lua, t.scheme, t.channel, 1);
+			if (!msg)
+				return luaL_error(lua, "Failed to convert message %d: %s", i, self->encoder.error.c_str());
+			self->result->outputs.emplace_back(target, msg);
+		}
+		return 0;
+	}
+
+	static int _lua_msg_patch(lua_State * lua)
+	{
+		if (auto self = _lua_self(lua); self)
+			return msg_patch(lua, self->encoder);
+		return luaL_error(lua, "Non-userdata value in upvalue");
+	}
+
+	static int _lua_profile_dump(lua_State * lua)
+	{
+		auto self = _lua_self(lua);
+		if (!self)
+			return luaL_error(lua, "Non-userdata value in upvalue");
+		if (!self->profiler)
+			return luaL_error(lua, "Profiler is disabled");
+		auto filename = luaL_optstring(lua, 1, self->profile_file.c_str());
+		if (auto r = self->profiler->dump(filename); r)
+			return luaL_error(lua, "Failed to write profile into '%s': %s", filename, strerror(r));
+		return 0;
+	}
+
+	static int _lua_rebind_hooks(lua_State * lua)
+	{
+		if (auto self = _lua_self(lua); self) {
+			self->bind(lua);
+			return 0;
+		}
+		return luaL_error(lua, "Non-userdata value in upvalue");
+	}
+};
+
+} // namespace tll::lua
+
+#endif//_TLL_LUA_SHARD_H
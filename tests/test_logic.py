@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 # vim: sts=4 sw=4 et
 
+import decimal
 import decorator
 import os
 import pytest
@@ -47,6 +48,7 @@ end
 
 function tll_on_channel_input(channel, type, seq, name, data)
     if type ~= 0 then return; end
+    assert(channel == tll_self_channels.input[1] or channel == tll_self_channels.input[2], "channel object is not reused")
     for i,c in ipairs(tll_self_channels.output) do
         c:post(seq, name, tostring(data) .. ":" .. channel.name)
     end
@@ -103,8 +105,9 @@ def test_forward_checks(context):
     with pytest.raises(TLLError): context.Channel('lua-forward://;name=forward;tll.channel.input=c0,c1;tll.channel.output=c2,c3')
     context.Channel('lua-forward://;name=forward;tll.channel.input=c0;tll.channel.output=c1;code=""')
 
+@pytest.mark.parametrize("native", ['yes', 'no'])
 @asyncloop_run
-async def test_forward(asyncloop):
+async def test_forward(asyncloop, native):
     cfg = Config.load('''yamls://
 mock:
   input.url: direct://
@@ -127,6 +130,7 @@ function tll_on_data(seq, name, data)
     tll_output_post(seq, name, data)
 end
 '''
+    cfg['channel.lua.native-convert'] = native
     cfg['mock.input.scheme'] = '''yamls://
 - name: Data
   id: 10
@@ -154,6 +158,40 @@ end
     mock.io('input').post({'f0': -1}, name='Data')
     assert mock.channel.state == mock.channel.State.Error
 
+@asyncloop_run
+async def test_forward_message(asyncloop):
+    cfg = Config.load('''yamls://
+mock:
+  input.url: direct://
+  output.url: direct://
+channel:
+  tll.proto: lua-forward
+  tll.channel:
+    input: input
+    output: output
+  name: forward
+''')
+    cfg['channel.code'] = '''
+function tll_on_data_Data(seq, name, data)
+    tll_output_post(seq, name, data)
+end
+'''
+    cfg['mock.input.scheme'] = cfg['mock.output.scheme'] = '''yamls://
+- {name: Data, id: 10, fields: [{name: f0, type: int32}]}
+- {name: Skip, id: 20, fields: [{name: f0, type: int32}]}
+'''
+
+    mock = Mock(asyncloop, cfg)
+    mock.open()
+
+    out = mock.io('output')
+
+    mock.io('input').post({'f0': 10}, name='Skip', seq=10)
+    mock.io('input').post({'f0': 20}, name='Data', seq=20)
+    m = await out.recv()
+    assert (m.seq, out.unpack(m).f0) == (20, 20)
+    assert mock.channel.state == mock.channel.State.Active
+
 @asyncloop_run
 async def test_forward_stream(asyncloop, tmp_path):
     cfg = Config.load(f'''yamls://
@@ -185,3 +223,125 @@ end
     mock.io('input').post(b'yyy', seq=20)
 
     assert mock.channel.config.sub('info.stream-open').as_dict() == {'mode': 'seq-data', 'seq': '20'}
+
+@pytest.mark.parametrize("native", ['yes', 'no'])
+@asyncloop_run
+async def test_forward_convert(asyncloop, native):
+    cfg = Config.load('''yamls://
+mock:
+  input.url: direct://
+  output.url: direct://
+channel:
+  tll.proto: lua-forward
+  tll.channel:
+    input: input
+    output: output
+  name: forward
+''')
+    cfg['channel.code'] = '''
+function tll_on_data(seq, name, data)
+    tll_output_post(seq, name, data)
+end
+'''
+    cfg['channel.lua.native-convert'] = native
+    cfg['mock.input.scheme'] = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int8}
+    - {name: s1, type: string}
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int16}
+    - {name: e0, type: int8, options.type: enum, enum: {A: 1, B: 2}}
+    - {name: str, type: string}
+    - {name: sub, type: Sub}
+    - {name: list, type: 'Sub[4]'}
+    - {name: extra, type: int32}
+'''
+
+    cfg['mock.output.scheme'] = '''yamls://
+- name: Sub
+  fields:
+    - {name: s1, type: byte8, options.type: string}
+    - {name: s0, type: int64}
+- name: Data
+  id: 10
+  fields:
+    - {name: e0, type: uint16, options.type: enum, enum: {B: 20, A: 10}}
+    - {name: f0, type: int64}
+    - {name: str, type: string}
+    - {name: sub, type: Sub}
+    - {name: list, type: '*Sub'}
+    - {name: missing, type: int32}
+'''
+
+    mock = Mock(asyncloop, cfg)
+    mock.open()
+
+    out = mock.io('output')
+
+    mock.io('input').post({'f0': -1000, 'e0': 2, 'str': 'string', 'sub': {'s0': 1, 's1': 'sub'}, 'list': [{'s0': 2, 's1': 'a'}, {'s0': 3}], 'extra': 100}, name='Data', seq=10)
+    m = await out.recv()
+    assert m.seq == 10
+    r = out.unpack(m)
+    assert r.e0.name == 'B'
+    r = r.as_dict()
+    del r['e0']
+    assert r == {'f0': -1000, 'str': 'string', 'sub': {'s0': 1, 's1': 'sub'}, 'list': [{'s0': 2, 's1': 'a'}, {'s0': 3, 's1': ''}], 'missing': 0}
+
+    mock.io('input').post({'sub': {'s1': 'long string'}}, name='Data', seq=20)
+    assert mock.channel.state == mock.channel.State.Error
+
+@pytest.mark.parametrize("mode", ['error', 'trim'])
+@asyncloop_run
+async def test_forward_convert_rescale(asyncloop, mode):
+    cfg = Config.load('''yamls://
+mock:
+  input.url: direct://
+  output.url: direct://
+channel:
+  tll.proto: lua-forward
+  tll.channel:
+    input: input
+    output: output
+  name: forward
+  lua.native-convert: yes
+''')
+    cfg['channel.code'] = '''
+function tll_on_data(seq, name, data)
+    tll_output_post(seq, name, data)
+end
+'''
+    cfg['channel.lua.overflow-mode'] = mode
+    cfg['mock.input.scheme'] = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: up, type: int64, options.type: fixed1}
+    - {name: down, type: int64, options.type: fixed3}
+'''
+
+    cfg['mock.output.scheme'] = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: up, type: int64, options.type: fixed4}
+    - {name: down, type: int64, options.type: fixed1}
+'''
+
+    mock = Mock(asyncloop, cfg)
+    mock.open()
+
+    out = mock.io('output')
+
+    mock.io('input').post({'up': decimal.Decimal('1.5'), 'down': decimal.Decimal('-1.239')}, name='Data', seq=10)
+    r = out.unpack(await out.recv())
+    assert (r.up, r.down) == (decimal.Decimal('1.5'), decimal.Decimal('-1.2'))
+
+    mock.io('input').post({'up': decimal.Decimal('-1e17')}, name='Data', seq=20)
+    if mode == 'error':
+        assert mock.channel.state == mock.channel.State.Error
+    else:
+        r = out.unpack(await out.recv())
+        assert r.up == decimal.Decimal(-2 ** 63).scaleb(-4)
@@ -66,7 +66,7 @@ end
     assert measure.state == measure.State.Opening
 
     assert measure.scheme != None
-    assert [m.name for m in measure.scheme.messages] == ['Data']
+    assert [m.name for m in measure.scheme.messages] == ['Data', 'Summary']
 
     oc.post({'time': 100}, seq=10, name='Time', type=oc.Type.Control)
     ic.post({}, name='Activate')
@@ -82,3 +82,172 @@ end
 
     ic.post({}, name='Done')
     assert measure.state == measure.State.Closed
+
+def test_window(context, asyncloop):
+    config = Config.load(f'''yamls://
+mock:
+  input:
+    url: direct://
+  output:
+    url: direct://
+channel:
+  url: 'lua-measure://;tll.channel.input=input;tll.channel.output=output'
+  window: 4
+''')
+
+    config['mock.input.scheme'] = DATA
+    config['mock.output.scheme-control'] = CONTROL
+    config['channel.code'] = '''
+function tll_on_data(seq, name, data)
+    return data.seq
+end
+'''
+
+    mock = Mock(asyncloop, config)
+    mock.open()
+
+    measure = mock.channel
+    ic, oc = mock.io('input', 'output')
+    assert measure.state == measure.State.Active
+
+    oc.post({'time': 100}, seq=1, name='Time', type=oc.Type.Control)
+    oc.post({'time': 200}, seq=2, name='Time', type=oc.Type.Control)
+    oc.post({'time': 500}, seq=5, name='Time', type=oc.Type.Control) # Evicts seq 1
+
+    ic.post({'seq': 1}, time=1000, name='Data')
+    ic.post({'seq': 2}, time=1000, name='Data')
+    ic.post({'seq': 5}, time=1000, name='Data')
+
+    assert [(m.seq, measure.unpack(m).value) for m in measure.result] == [(2, 800), (5, 500)]
+
+def test_summary(context, asyncloop):
+    config = Config.load(f'''yamls://
+mock:
+  input:
+    url: direct://
+  output:
+    url: direct://
+channel:
+  url: 'lua-measure://;tll.channel.input=input;tll.channel.output=output'
+  report: summary
+  summary-count: 100
+''')
+
+    config['mock.input.scheme'] = DATA
+    config['mock.output.scheme-control'] = CONTROL
+    config['channel.code'] = '''
+function tll_on_data(seq, name, data)
+    return data.seq
+end
+'''
+
+    mock = Mock(asyncloop, config)
+    mock.open()
+
+    measure = mock.channel
+    ic, oc = mock.io('input', 'output')
+    assert measure.state == measure.State.Active
+
+    for i in range(1, 151):
+        oc.post({'time': 0}, seq=i, name='Time', type=oc.Type.Control)
+        ic.post({'seq': i}, time=i * 1000, name='Data')
+
+    assert [m.msgid for m in measure.result] == [20]
+    s = measure.unpack(measure.result[0])
+    assert (s.count, s.min, s.max) == (100, 1000, 100000)
+    assert abs(s.p50 - 50000) <= 50000 / 64
+    assert abs(s.p99 - 99000) <= 99000 / 64
+
+    measure.close()
+    assert [m.msgid for m in measure.result] == [20, 20]
+    assert measure.unpack(measure.result[1]).count == 50
+
+@asyncloop_run
+async def test_summary_timer(asyncloop):
+    config = Config.load(f'''yamls://
+mock:
+  input:
+    url: direct://
+  output:
+    url: direct://
+channel:
+  url: 'lua-measure://;tll.channel.input=input;tll.channel.output=output'
+  report: summary
+  summary-interval: 10ms
+''')
+
+    config['mock.input.scheme'] = DATA
+    config['mock.output.scheme-control'] = CONTROL
+    config['channel.code'] = '''
+function tll_on_data(seq, name, data)
+    return data.seq
+end
+'''
+
+    mock = Mock(asyncloop, config)
+    mock.open()
+
+    measure = mock.channel
+    ic, oc = mock.io('input', 'output')
+    assert measure.state == measure.State.Active
+
+    for i in range(1, 4):
+        oc.post({'time': 0}, seq=i, name='Time', type=oc.Type.Control)
+        ic.post({'seq': i}, time=i * 1000, name='Data')
+
+    # No new samples, summary is reported by timer
+    m = await measure.recv(0.5)
+    assert m.msgid == 20
+    assert measure.unpack(m).count == 3
+
+def test_key(context, asyncloop):
+    config = Config.load(f'''yamls://
+mock:
+  input:
+    url: direct://
+  output:
+    url: direct://
+channel:
+  url: 'lua-measure://;tll.channel.input=input;tll.channel.output=output'
+  key-window: 16
+''')
+
+    config['mock.input.scheme'] = DATA
+    config['mock.output.scheme-control'] = CONTROL
+    config['channel.code'] = '''
+function tll_on_request(seq, name, data)
+    if seq == 3 then return nil end
+    if seq == 6 then return "close" end
+    return string.format("request-%d", seq)
+end
+
+function tll_on_data(seq, name, data)
+    if data.seq == 4 then return 4 end
+    if data.seq == 6 then return "close" end -- Key, not a command
+    return string.format("request-%d", data.seq)
+end
+'''
+
+    mock = Mock(asyncloop, config)
+    mock.open()
+
+    measure = mock.channel
+    ic, oc = mock.io('input', 'output')
+    assert measure.state == measure.State.Active
+
+    oc.post({'time': 100}, seq=1, name='Time', type=oc.Type.Control)
+    oc.post({'time': 200}, seq=2, name='Time', type=oc.Type.Control)
+    oc.post({'time': 300}, seq=3, name='Time', type=oc.Type.Control) # Skipped
+    oc.post({'time': 400}, seq=4, name='Time', type=oc.Type.Control) # Integer key does not match string
+
+    ic.post({'seq': 2}, seq=20, time=1000, name='Data')
+    ic.post({'seq': 3}, seq=30, time=1000, name='Data')
+    ic.post({'seq': 4}, seq=40, time=1000, name='Data')
+    ic.post({'seq': 5}, seq=50, time=1000, name='Data') # Response before request
+    oc.post({'time': 900}, seq=5, name='Time', type=oc.Type.Control)
+    ic.post({'seq': 1}, seq=10, time=1000, name='Data')
+    oc.post({'time': 500}, seq=6, name='Time', type=oc.Type.Control)
+    ic.post({'seq': 6}, seq=60, time=1000, name='Data')
+
+    assert measure.state == measure.State.Active
+    assert [(m.seq, measure.unpack(m).value) for m in measure.result] == [(20, 800), (5, 100), (10, 900), (60, 500)]
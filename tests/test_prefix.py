@@ -1560,3 +1560,745 @@ code: 'function tll_on_active() tll_callback({type="Control", name="Extra", seq=
     c.open()
     assert [m.name for m in c.scheme_control.messages] == ['Extra', 'Block']
     assert [(m.msgid, m.seq) for m in c.result] == [(1000, 100)]
+
+def test_batch(context):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}]}]'
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+lua.dump: yes
+lua.batch-size: 2
+''')
+    cfg['code'] = '''
+function tll_on_data_batch(batch)
+    local list = {}
+    for i, seq, name, data in pairs(batch) do
+        assert(batch[i].seq == seq, "invalid seq in message object")
+        list[i] = {seq = seq + 100 * #batch, name = name, data = { f0 = data.f0 }}
+    end
+    tll_callback_batch(list)
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    for i in range(3):
+        s.post({'f0': i}, name='Data', seq=i)
+
+    assert [(m.seq, c.unpack(m).f0) for m in c.result] == [(200, 0), (201, 1)]
+
+    c.process()
+    assert [(m.seq, c.unpack(m).f0) for m in c.result] == [(200, 0), (201, 1), (102, 2)]
+    c.process()
+    assert len(c.result) == 3
+
+def test_batch_reflection_cache(context):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}]}]'
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+lua.batch-size: 2
+lua.reflection-cache: yes
+''')
+    cfg['code'] = '''
+function tll_on_data_batch(batch)
+    local list = {}
+    for i, seq, name, data in pairs(batch) do
+        list[i] = data
+    end
+    tll_callback(1, "Data", { f0 = list[1].f0 * 10 + list[2].f0 })
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    s.post({'f0': 1}, name='Data', seq=1)
+    s.post({'f0': 2}, name='Data', seq=2)
+
+    assert [(m.seq, c.unpack(m).f0) for m in c.result] == [(1, 12)]
+
+def test_encode_metatable(context):
+    cfg = Config.load('''yamls://
+tll.proto: lua+null
+name: lua
+lua.dump: yes
+''')
+    cfg['scheme'] = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int16}
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int32}
+    - {name: f1, type: int8, options.type: enum, enum: {A: 1, B: 2}}
+    - {name: sub, type: Sub}
+    - {name: list, type: '*Sub'}
+'''
+    cfg['code'] = '''
+defaults = { f0 = 100, f1 = "B" }
+function tll_on_post(seq, name, data)
+    tll_callback(seq, name, data)
+    tll_callback(seq, name, setmetatable({ sub = { s0 = seq } }, { __index = defaults }))
+    tll_callback(seq, name, { f0 = seq, f1 = 1, list = { { s0 = 1 }, setmetatable({}, { __index = { s0 = 2 } }) } })
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+    assert c.state == c.State.Active
+
+    for i in range(2):
+        c.result = []
+        c.post({'f0': 10, 'f1': 'A', 'sub': {'s0': 20}}, name='Data', seq=i)
+        result = [c.unpack(m) for m in c.result]
+        assert [(m.f0, m.f1.name, m.sub.s0, [x.s0 for x in m.list]) for m in result] == [
+            (10, 'A', 20, []),
+            (100, 'B', i, []),
+            (i, 'A', 0, [1, 2]),
+        ]
+
+def test_encode_reflection_copy(context):
+    cfg = Config.load('''yamls://
+tll.proto: lua+null
+name: lua
+lua.dump: yes
+''')
+    cfg['scheme'] = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int16}
+    - {name: str, type: string}
+- name: Header
+  fields:
+    - {name: h0, type: int64}
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int32}
+    - {name: header, type: Header}
+    - {name: array, type: 'Header[4]'}
+    - {name: list, type: '*Sub'}
+    - {name: nested, type: '**int8'}
+'''
+    cfg['code'] = '''
+function tll_on_post(seq, name, data)
+    copy = tll_msg_copy(data)
+    copy.f0 = 100
+    tll_callback(seq, name, copy)
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+    assert c.state == c.State.Active
+
+    data = {'f0': 10, 'header': {'h0': 20}, 'array': [{'h0': 1}, {'h0': 2}],
+            'list': [{'s0': 1, 'str': 'a' * 32}, {'s0': 2, 'str': ''}, {'s0': 3, 'str': 'b'}],
+            'nested': [[1, 2], [], [3]]}
+    c.post(data, name='Data', seq=10)
+    assert [m.seq for m in c.result] == [10]
+    assert c.unpack(c.result[0]).as_dict() == dict(data, f0=100)
+
+def test_msg_patch(context):
+    cfg = Config.load('''yamls://
+tll.proto: lua+null
+name: lua
+lua.dump: yes
+''')
+    cfg['scheme'] = '''yamls://
+- name: Header
+  fields:
+    - {name: h0, type: int64}
+    - {name: h1, type: int64}
+- name: Data
+  id: 10
+  fields:
+    - {name: pmap, type: uint8, options.pmap: yes}
+    - {name: f0, type: int32}
+    - {name: opt, type: int32, options.optional: yes}
+    - {name: header, type: Header}
+    - {name: str, type: string}
+    - {name: list, type: '*int8'}
+'''
+    cfg['code'] = '''
+function tll_on_post(seq, name, data)
+    local patched = tll_msg_patch(data, {f0 = 100, opt = 200, ["header.h1"] = 300, str = "longer string"})
+    assert(patched.f0 == 100, "invalid f0: " .. tostring(patched.f0))
+    assert(data.f0 == 10, "original message modified")
+    tll_callback(seq, name, patched)
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+    assert c.state == c.State.Active
+
+    c.post({'f0': 10, 'header': {'h0': 1, 'h1': 2}, 'str': 'short', 'list': [1, 2, 3]}, name='Data', seq=10)
+    assert [m.seq for m in c.result] == [10]
+    assert c.unpack(c.result[0]).as_dict() == {'f0': 100, 'opt': 200, 'header': {'h0': 1, 'h1': 300}, 'str': 'longer string', 'list': [1, 2, 3]}
+
+def test_on_data_message(context):
+    scheme = '''yamls://
+- {name: Data, id: 10, fields: [{name: f0, type: int32}]}
+- {name: Other, id: 20, fields: [{name: f0, type: int32}]}
+- {name: Skip, id: 30, fields: [{name: f0, type: int32}]}
+'''
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+lua.dump: yes
+''')
+    cfg['code'] = '''
+function tll_on_data_Data(seq, name, data)
+    tll_callback(seq + 100, name, { f0 = data.f0 })
+end
+
+function tll_on_data(seq, name, data)
+    tll_callback(seq + 200, name, { f0 = data.f0 })
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    s.post({'f0': 1}, name='Data', seq=1)
+    s.post({'f0': 2}, name='Other', seq=2)
+    assert [(m.seq, m.msgid, c.unpack(m).f0) for m in c.result] == [(101, 10, 1), (202, 20, 2)]
+
+def test_on_data_batch_clash(context):
+    scheme = 'yamls://[{name: batch, id: 10, fields: [{name: f0, type: int32}]}]'
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+''')
+    cfg['code'] = '''
+function tll_on_data_batch(batch)
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Error
+
+def test_rebind_hooks(context):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}]}]'
+    cfg = Config.load('''yamls://
+tll.proto: lua+null
+name: lua
+lua.dump: yes
+''')
+    cfg['code'] = '''
+function post_second(seq, name, data)
+    tll_callback(seq + 200, name, { f0 = data.f0 })
+end
+
+function tll_on_post(seq, name, data)
+    tll_callback(seq + 100, name, { f0 = data.f0 })
+    tll_on_post = post_second
+    if seq == 1 then
+        tll_rebind_hooks()
+    end
+end
+'''
+    cfg['scheme'] = scheme
+
+    c = Accum(cfg, context=context)
+    c.open()
+    assert c.state == c.State.Active
+
+    c.post({'f0': 0}, name='Data', seq=0)
+    c.post({'f0': 1}, name='Data', seq=1)
+    c.post({'f0': 2}, name='Data', seq=2)
+    assert [m.seq for m in c.result] == [100, 101, 202]
+
+def test_builder(context):
+    scheme = '''yamls://
+- name: Header
+  fields:
+    - {name: ts, type: int64}
+- name: Data
+  id: 10
+  fields:
+    - {name: pmap, type: uint8, options.pmap: yes}
+    - {name: header, type: Header}
+    - {name: f0, type: int32}
+    - {name: opt, type: int32, options.optional: yes}
+    - {name: e0, type: int8, options.type: enum, enum: {Z: 0, A: 1, B: 2}}
+    - {name: str, type: string}
+'''
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+lua.dump: yes
+''')
+    cfg['code'] = '''
+function tll_on_active()
+    builder = tll_self_child:builder("Data")
+    builder.e0 = "B"
+    builder["header.ts"] = 1000
+end
+
+function tll_on_post(seq, name, data)
+    if data.f0 == 0 then
+        builder:reset()
+    else
+        builder.f0 = data.f0
+        builder.opt = data.f0 * 10
+    end
+    builder:post(seq)
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    c.post({'f0': 10}, name='Data', seq=1)
+    c.post({'f0': 0}, name='Data', seq=2)
+    assert [m.seq for m in s.result] == [1, 2]
+    r = s.unpack(s.result[0])
+    assert (r.f0, r.opt, r.e0.name, r.header.ts) == (10, 100, 'B', 1000)
+    r = s.unpack(s.result[1])
+    assert (r.f0, r.e0.name, r.header.ts) == (0, 'Z', 0)
+    assert 'opt' not in r.as_dict()
+
+def test_builder_string(context):
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int32}
+    - {name: str, type: string}
+'''
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+''')
+    cfg['code'] = '''
+function tll_on_active()
+    builder = tll_self_child:builder("Data")
+end
+
+function tll_on_post(seq, name, data)
+    if seq > 1 then
+        assert(not pcall(function() builder.str = "error" end), "second assignment succeeded")
+        builder:reset()
+    end
+    builder.f0 = seq
+    builder.str = data.str
+    builder:post(seq)
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    c.post({'str': 'first'}, name='Data', seq=1)
+    c.post({'str': 'second'}, name='Data', seq=2)
+    assert [(m.seq, s.unpack(m).str) for m in s.result] == [(1, 'first'), (2, 'second')]
+    assert len(s.result[1].data) < 12 + len('first') + len('second') # Tail is not accumulated
+
+def test_code_cache(context, tmp_path):
+    code = tmp_path / 'code.lua'
+    code.write_text('''
+function tll_on_post(seq, name, data)
+    tll_callback(seq + 100, name, data)
+end
+''')
+    cache = tmp_path / 'cache'
+    cache.mkdir()
+
+    for i in range(2):
+        c = Accum(f'lua+null://;name=lua{i};lua.code=file://{code};lua.code-cache-dir={cache}', context=context)
+        c.open()
+        c.post(b'xxx', seq=i)
+        assert [(m.seq, m.data.tobytes()) for m in c.result] == [(100 + i, b'xxx')]
+        c.close()
+        assert len(list(cache.glob('*.luac'))) == 1
+
+@pytest.mark.parametrize("allocator", ['libc', 'pool'])
+def test_memory_limit(context, allocator):
+    cfg = Config.load(f'''yamls://
+tll.proto: lua+null
+name: lua
+lua.allocator: {allocator}
+lua.memory-limit: 1mb
+''')
+    cfg['code'] = '''
+function tll_on_post(seq, name, data)
+    local list = {}
+    for i = 1, seq do
+        list[i] = { i }
+    end
+    tll_callback(seq, name, data)
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+    assert c.state == c.State.Active
+
+    c.post(b'xxx', seq=100)
+    assert [m.seq for m in c.result] == [100]
+
+    with pytest.raises(TLLError): c.post(b'xxx', seq=100000)
+    assert c.state == c.State.Error
+
+@pytest.mark.parametrize("allocator", ["libc", "pool"])
+def test_memory_limit_push(context, allocator):
+    cfg = Config.load(f'''yamls://
+tll.proto: lua+null
+name: lua
+lua.allocator: {allocator}
+lua.memory-limit: 1mb
+lua.message-mode: binary
+''')
+    cfg['code'] = '''
+function tll_on_post(seq, name, data)
+    hold = data
+    tll_callback(seq, name, "ok")
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+    assert c.state == c.State.Active
+
+    c.post(b'x' * 600 * 1024, seq=0)
+    assert [m.seq for m in c.result] == [0]
+
+    # Limit is hit while data is pushed into Lua stack, before hook is called
+    with pytest.raises(TLLError): c.post(b'y' * 600 * 1024, seq=1)
+    assert c.state == c.State.Error
+    assert [m.seq for m in c.result] == [0]
+
+def test_gc_idle(context):
+    cfg = Config.load('''yamls://
+tll.proto: lua+null
+name: lua
+lua.gc: idle
+lua.gc-step: 1024
+''')
+    cfg['code'] = '''
+function tll_on_post(seq, name, data)
+    if seq == 0 then
+        local list = {}
+        for i = 1, 10000 do
+            list[i] = { i }
+        end
+    end
+    tll_callback(seq, name, string.format("%s %d", collectgarbage("isrunning"), math.floor(collectgarbage("count"))))
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+    assert c.state == c.State.Active
+
+    c.post(b'', seq=0)
+    c.post(b'', seq=1)
+
+    for _ in range(100):
+        c.process()
+
+    c.post(b'', seq=2)
+
+    result = [m.data.tobytes().decode().split() for m in c.result]
+    assert [r[0] for r in result] == ['false'] * 3
+    assert int(result[2][1]) < int(result[1][1])
+
+def test_hook_stat(context):
+    cfg = Config.load('''yamls://
+tll.proto: lua+null
+name: lua
+stat: yes
+fragile: no
+lua.hook-stat: yes
+''')
+    cfg['code'] = '''
+function tll_on_post(seq, name, data)
+    if seq == 1 then
+        error("fail")
+    end
+    tll_callback(seq, name, data)
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+
+    c.post(b'xxx', seq=0)
+    with pytest.raises(TLLError): c.post(b'xxx', seq=1)
+    assert c.state == c.State.Active
+
+    block = [b for b in context.stat_list if b.name == 'lua'][0]
+    fields = {f.name: f for f in block.swap()}
+    for n in ['rx', 'tx', 'filter', 'enc', 'rxerr', 'txerr', 'ferr', 'encerr']:
+        assert n in fields
+    assert fields['txerr'].value == 1
+
+def test_profile(context, tmp_path):
+    cfg = Config.load('''yamls://
+tll.proto: lua+null
+name: lua
+lua.profile: yes
+lua.profile-interval: 100
+''')
+    cfg['lua.profile-file'] = str(tmp_path / 'lua.folded')
+    cfg['code'] = '''
+function busy(n)
+    local r = 0
+    for i = 1, n do
+        r = r + i % 7
+    end
+    return r
+end
+
+function tll_on_post(seq, name, data)
+    busy(10000)
+    if seq == 1 then
+        tll_profile_dump(data)
+    end
+end
+'''
+
+    c = Accum(cfg, context=context)
+    c.open()
+
+    c.post(b'', seq=0)
+    c.post(str(tmp_path / 'dump.folded').encode(), seq=1)
+
+    def load(path):
+        r = {}
+        for l in open(path):
+            stack, count = l.rsplit(' ', 1)
+            r[stack] = int(count)
+        return r
+
+    dump = load(tmp_path / 'dump.folded')
+    assert [s for s in dump if 'busy' in s.split(';')[-1]] != []
+
+    c.close()
+    result = load(tmp_path / 'lua.folded')
+    assert sum(result.values()) >= sum(dump.values())
+
+@pytest.mark.parametrize("order", ["global", "shard"])
+def test_shards(context, order):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}, {name: shard, type: int32}, {name: count, type: int32}]}]'
+    cfg = Config.load(f'''yamls://
+tll.proto: lua+direct
+name: lua
+lua.shards: 4
+lua.shard-key: addr
+lua.shard-order: {order}
+''')
+    cfg['code'] = '''
+function tll_on_data(seq, name, data)
+    tll_callback(seq, name, { f0 = data.f0 * 10, shard = tll_shard, count = tll_shard_count })
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    for i in range(100):
+        s.post({'f0': i}, name='Data', seq=i, addr=i % 7)
+
+    for _ in range(10000):
+        if len(c.result) == 100:
+            break
+        c.process()
+
+    result = [(m.seq, c.unpack(m)) for m in c.result]
+    assert len(result) == 100
+    if order == 'global':
+        assert [seq for seq, _ in result] == list(range(100))
+    else:
+        assert sorted([seq for seq, _ in result]) == list(range(100))
+        for shard in range(4):
+            seqs = [seq for seq, m in result if m.shard == shard]
+            assert seqs == sorted(seqs)
+    for seq, m in result:
+        assert m.f0 == seq * 10
+        assert m.shard == (seq % 7) % 4
+        assert m.count == 4
+
+def test_shards_key_function(context):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}, {name: shard, type: int32}]}]'
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+lua.shards: 2
+lua.shard-key: function
+''')
+    cfg['code'] = '''
+function tll_shard_key(seq, name, data)
+    if data.f0 < 0 then return 0.5 end
+    return string.format("key-%d", data.f0 % 3)
+end
+
+function tll_on_data(seq, name, data)
+    tll_callback(seq, name, { f0 = data.f0, shard = tll_shard })
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    for i in range(30):
+        s.post({'f0': i}, name='Data', seq=i)
+    s.post({'f0': -1}, name='Data', seq=30) # Non-integer key, message is dropped
+
+    for _ in range(10000):
+        if len(c.result) == 30:
+            break
+        c.process()
+    for _ in range(10):
+        c.process()
+
+    result = [(m.seq, c.unpack(m)) for m in c.result]
+    assert [seq for seq, _ in result] == list(range(30))
+    shards = {}
+    for seq, m in result:
+        assert shards.setdefault(m.f0 % 3, m.shard) == m.shard
+
+def test_shards_handlers(context):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}]}, {name: Other, id: 20, fields: [{name: f0, type: int32}]}]'
+    cfg = Config.load(f'''yamls://
+tll.proto: lua+direct
+name: lua
+lua.shards: 2
+''')
+    cfg['code'] = '''
+function tll_on_data_Data(seq, name, data)
+    tll_callback_batch({{seq = seq, name = name, data = { f0 = data.f0 * 10 }}, {seq = seq, name = name, data = { f0 = tll_shard }}})
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    s.post({'f0': 1}, name='Data', seq=1)
+    s.post({'f0': 2}, name='Other', seq=2) # No handler, passed through
+
+    for _ in range(10000):
+        if len(c.result) == 3:
+            break
+        c.process()
+
+    assert [(m.seq, m.msgid, c.unpack(m).f0) for m in c.result] == [(1, 10, 10), (1, 10, 0), (2, 20, 2)]
+
+def test_shards_profile(context, tmp_path):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}]}]'
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+lua.shards: 2
+lua.profile: yes
+lua.profile-interval: 100
+''')
+    cfg['lua.profile-file'] = str(tmp_path / 'lua.folded')
+    cfg['code'] = '''
+function busy(n)
+    local r = 0
+    for i = 1, n do
+        r = r + i % 7
+    end
+    return r
+end
+
+function tll_on_data(seq, name, data)
+    busy(10000)
+    tll_callback(seq, name, data)
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    for i in range(4):
+        s.post({'f0': i}, name='Data', seq=i)
+
+    for _ in range(10000):
+        if len(c.result) == 4:
+            break
+        c.process()
+    assert len(c.result) == 4
+
+    c.close()
+    assert (tmp_path / 'lua.folded.shard0').exists()
+    assert (tmp_path / 'lua.folded.shard1').exists()
+
+def test_offload(context):
+    scheme = 'yamls://[{name: Data, id: 10, fields: [{name: f0, type: int32}, {name: count, type: int32}]}]'
+    cfg = Config.load('''yamls://
+tll.proto: lua+direct
+name: lua
+lua.offload: yes
+lua.shard-queue-size: 8
+''')
+    cfg['code'] = '''
+function tll_on_data(seq, name, data)
+    tll_callback(seq, name, { f0 = data.f0, count = tll_shard_count })
+end
+'''
+    cfg['scheme'] = scheme
+
+    s = Accum('direct://', name='server', scheme=scheme, context=context)
+    s.open()
+    c = Accum(cfg, context=context, master=s)
+    c.open()
+    assert c.state == c.State.Active
+
+    for i in range(50):
+        s.post({'f0': i}, name='Data', seq=i)
+
+    for _ in range(10000):
+        if len(c.result) == 50:
+            break
+        c.process()
+
+    assert [(m.seq, c.unpack(m).f0, c.unpack(m).count) for m in c.result] == [(i, i, 1) for i in range(50)]
+    c.close()
+    assert c.state == c.State.Closed
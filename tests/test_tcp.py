@@ -2,8 +2,10 @@
 # vim: sts=4 sw=4 et
 
 import decorator
+import pytest
 
 from tll.config import Url
+from tll.error import TLLError
 
 @decorator.decorator
 def asyncloop_run(f, asyncloop, *a, **kw):
@@ -47,3 +49,44 @@ end
 
     m = await c.recv(0.001)
     assert m.data.tobytes() == b'ZBXD\x01\x04\x00\x00\x00\x00\x00\x00\x00abcd'
+
+@asyncloop_run
+async def test_native(asyncloop, tmp_path):
+    url = Url.parse(f'tcp-lua://{tmp_path}/tcp.sock;mode=server;name=server;dump=frame')
+    url['code'] = '''
+frame_format = ">c4 i2 I4 x j"
+frame_fields = { "HDR", "msgid", "size", "seq" }
+'''
+    s = asyncloop.Channel(url)
+    s.open()
+    assert s.state == s.State.Active
+
+    c = asyncloop.Channel(f'tcp://{tmp_path}/tcp.sock;frame=none;dump=frame;name=client')
+    c.open()
+    assert c.State.Active == await c.recv_state(0.01)
+
+    m = await s.recv(0.001)
+    assert m.type == m.Type.Control
+    assert s.unpack(m).SCHEME.name == 'Connect'
+
+    c.post(b'HDR\x00\xff\xfe\x00\x00\x00\x04\x00\x00\x00\x00\x00\x00\x00\x01\x00abcd')
+
+    m = await s.recv(0.001)
+    assert (m.msgid, m.seq, m.data.tobytes()) == (-2, 256, b'abcd')
+
+    s.post(b'xyz', msgid=10, seq=20, addr=m.addr)
+
+    m = await c.recv(0.001)
+    assert m.data.tobytes() == b'HDR\x00\x00\x0a\x00\x00\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x14xyz'
+
+@pytest.mark.parametrize("format,fields", [
+    ("<i2", '{"size"}'), # Signed size
+    ("<I4 I4", '{"size"}'), # Fields count mismatch
+    ("<I4 s4", '{"size", 0}'), # Unsupported option
+    ("<I4", '{"msgid"}'), # No size
+])
+def test_native_invalid(context, tmp_path, format, fields):
+    url = Url.parse(f'tcp-lua://{tmp_path}/tcp.sock;mode=server;name=server')
+    url['code'] = f'frame_format = "{format}"\nframe_fields = {fields}\n'
+    s = context.Channel(url)
+    with pytest.raises(TLLError): s.open()